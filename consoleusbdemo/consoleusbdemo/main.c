@@ -23,6 +23,8 @@ usb_dev_handle *device_handle = NULL; // the device handle
 
 #define  UDI_VENDOR_LOOPBACK_SIZE    12
 
+#define TRANSFER_PERIOD_MS 100
+
 uint8_t udi_vendor_buf_out[UDI_VENDOR_LOOPBACK_SIZE] = "hello world";
 uint8_t udi_vendor_buf_in[UDI_VENDOR_LOOPBACK_SIZE];
 
@@ -183,10 +185,33 @@ int main(int argc, char *argv[])
 	usb_find_busses();  // find all busses
 	printf("Search device...\n");
 
+	// Periodic waitable timer: transfers stay on a 100 ms grid however long
+	// each one takes, where Sleep() added the transfer time to every period
+	HANDLE timer = CreateWaitableTimer(NULL, FALSE, NULL);
+	LARGE_INTEGER due, freq, next, now;
+	unsigned long missed = 0;
+
+	QueryPerformanceFrequency(&freq);
+	due.QuadPart = -(LONGLONG)TRANSFER_PERIOD_MS * 10000; // relative, 100 ns units
+	if (timer == NULL || !SetWaitableTimer(timer, &due, TRANSFER_PERIOD_MS, NULL, NULL, FALSE)) {
+		printf("error: cannot create the transfer timer\n");
+		return 1;
+	}
+	QueryPerformanceCounter(&next);
 	while (1)
 	{
 		transfer();
-		Sleep(100);
+		WaitForSingleObject(timer, INFINITE);
+		// An auto-reset timer signals once for any number of periods gone by
+		next.QuadPart += freq.QuadPart * TRANSFER_PERIOD_MS / 1000;
+		QueryPerformanceCounter(&now);
+		if (now.QuadPart - next.QuadPart >= freq.QuadPart * TRANSFER_PERIOD_MS / 1000) {
+			LONGLONG skipped = (now.QuadPart - next.QuadPart) / (freq.QuadPart * TRANSFER_PERIOD_MS / 1000);
+
+			missed += (unsigned long)skipped;
+			next.QuadPart += skipped * (freq.QuadPart * TRANSFER_PERIOD_MS / 1000);
+			printf("Missed %lu deadlines so far\n", missed);
+		}
 	}
 
 }
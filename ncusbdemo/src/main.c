@@ -5,6 +5,9 @@
 #include <string.h>
 #include <ncurses.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include "deadline.h"
+#include "sysfs.h"
 
 /**
 * Device vendor definition
@@ -17,6 +20,8 @@
 // the device's endpoints
 static unsigned char udi_vendor_ep_interrupt_in;
 static unsigned char udi_vendor_ep_interrupt_out;
+static unsigned char udi_vendor_ep_interrupt_interval; // bInterval
+static int device_high_speed = -1; // 1: high speed or faster, 0: full or low speed, -1: unknown
 
 char string_usb[100];
 
@@ -38,6 +43,21 @@ int opendevice(void);
 
 int x=0,y=5;
 
+// Deadline schedule of the loop back, see usbdemo's deadline.c
+static long period_us = 1000000; // -p, rounded up to the interrupt interval
+static struct sched sched;
+
+static void schedule(void)
+{
+	uint64_t interval = 0;
+
+	if (device_handle != NULL)
+		interval = sched_interrupt_interval(udi_vendor_ep_interrupt_interval, device_high_speed);
+	if (sched.running)
+		sched_stop(&sched);
+	sched_start(&sched, sched_align(period_us > 0 ? period_us * 1000ull : 1, interval));
+}
+
 void findendpoint(void)
 {
 	//if (opendevice())
@@ -67,6 +87,7 @@ void findendpoint(void)
 			unsigned char ep_add = endpoints[nb_ep].bEndpointAddress;
 			unsigned char dir_in = (ep_add & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
 			unsigned short ep_size = endpoints[nb_ep].wMaxPacketSize;
+			unsigned char ep_interval = endpoints[nb_ep].bInterval;
 
 			switch (ep_type) {
 			case USB_ENDPOINT_TYPE_INTERRUPT:
@@ -76,6 +97,7 @@ void findendpoint(void)
 				else {
 					udi_vendor_ep_interrupt_out = ep_add;
 				}
+				udi_vendor_ep_interrupt_interval = ep_interval;
 				break;
 			}
 		}
@@ -131,18 +153,40 @@ int opendevice(void)
 {
 	if (device_handle == NULL)
 	{
+		struct usbindex_entry entry;
+		int indexed;
+
 		clear();
 		mvprintw(y,x,"Opening\n");
 		refresh();
+		// The sysfs index knows whether a scan can find anything, and the speed
+		indexed = usbindex_lookup(DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, NULL, &entry);
+		if (indexed == 0)
+		{
+			clear();
+			mvprintw(y,x,"Device not found\n");
+			refresh();
+			return 0;
+		}
 		usb_find_devices(); // find all connected devices
 		// Search and open device
 		for (bus = usb_get_busses(); bus; bus = bus->next)
 		{
+			if (indexed > 0 && atoi(bus->dirname) != entry.busnum)
+				continue;
 			for (device = bus->devices; device; device = device->next)
 			{
-				if (device->descriptor.idVendor == DEVICE_VENDOR_VID && device->descriptor.idProduct == DEVICE_VENDOR_PID)
+				if (indexed > 0 ? atoi(device->filename) == entry.devnum
+					: device->descriptor.idVendor == DEVICE_VENDOR_VID && device->descriptor.idProduct == DEVICE_VENDOR_PID)
 				{
 					device_handle = usb_open(device);
+					if (device_handle == NULL)
+						continue;
+					// libusb-0.1 does not tell the speed, sysfs does; a USB 1.x device is full speed
+					if (indexed > 0 && entry.speed)
+						device_high_speed = entry.speed >= 480;
+					else
+						device_high_speed = device->descriptor.bcdUSB < 0x0200 ? 0 : -1;
 					clear();
 					mvprintw(y,x,"Device open\n");
 					mvprintw(0,0,"- Device version: %d.%d\n", device->descriptor.bcdDevice >> 8, (device->descriptor.bcdDevice & 0xFF));
@@ -177,6 +221,8 @@ int opendevice(void)
 
 void transfer(void)
 {
+	static uint64_t print_ns;
+
 	if (device_handle != NULL)
 	{
 		if (udi_vendor_ep_interrupt_in && udi_vendor_ep_interrupt_out)
@@ -192,18 +238,40 @@ void transfer(void)
 				udi_vendor_ep_interrupt_out = 0;
 				return;
 			}
-			//clear();
-			mvprintw(y,x,"data: %02X %02X\n", udi_vendor_buf_in[0], udi_vendor_buf_in[1]);
-			refresh();
+			// Screen updates at most once a second, the schedule may be much faster
+			if (now_ns() - print_ns >= 1000000000u) {
+				mvprintw(y,x,"data: %02X %02X\n", udi_vendor_buf_in[0], udi_vendor_buf_in[1]);
+				mvprintw(y+1,x,"period: %.1f us%s, %llu transfers, %llu missed deadlines, late avg %.1f us, max %.1f us\n",
+					sched.period_ns / 1e3, device_high_speed < 0 ? " (speed unknown)" : "",
+					(unsigned long long)sched.ticks, (unsigned long long)sched.missed,
+					sched.late.count ? sched.late.sum_ns / 1e3 / sched.late.count : 0.0, sched.late.max_ns / 1e3);
+				refresh();
+				print_ns = now_ns();
+			}
 		}
 	}
-	else
-		opendevice();
+	else if (opendevice())
+		schedule(); // aligned to the interval of the device just opened
 }
 
 /// The main entry-point function.
 int main(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			period_us = atol(optarg);
+			break;
+		default:
+			printf("Usage: %s [-p period]\n", argv[0]);
+			printf("  -p period   microseconds between transfers, rounded up to the\n");
+			printf("              interrupt endpoint interval (default 1000000)\n");
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
 	// Ncurses initialization
 	initscr();
 	noecho();
@@ -221,10 +289,11 @@ int main(int argc, char *argv[])
 	mvprintw(y,x,"Search device...\n");
 	refresh();
 
+	schedule();
 	while (1)
 	{
 		transfer();
-		sleep(1);
+		sched_wait(&sched, -1);
 	}
 
 }
@@ -1,6 +1,6 @@
 #!/bin/sh
 make clean
 make distclean
-rm -rvf aclocal.m4 autom4te.cache compile config.h config.h.in config.log config.status configure depcomp install-sh Makefile Makefile.in missing stamp-h1
+rm -rvf aclocal.m4 autom4te.cache compile config.guess config.h config.h.in config.log config.status config.sub configure depcomp install-sh libtool ltmain.sh Makefile Makefile.in missing stamp-h1
 rm src/Makefile.in
 
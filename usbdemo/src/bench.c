@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "usbdemo.h"
+#include "stats.h"
+
+/**
+* Throughput sweep
+*
+* Every combination of endpoint type, payload size and queue depth is one
+* point. A point runs depth lanes, one thread each, that loop OUT/IN round
+* trips of size bytes on the endpoint pair: first BENCH_WARMUP_NS to get
+* the kernel, the controller and the firmware into a steady state, then
+* seconds of which every round trip started and finished in is counted.
+* CPU time is that of the whole process over the counted part. MB/s counts
+* the payload in both directions, as multi mode does. Each lane starts
+* every point with an adaptive timeout of its own within the -T bounds: a
+* 64 byte interrupt round trip says nothing about a 16 KiB bulk one.
+*
+* Results go to a CSV file, or JSON when the name ends in .json, and to
+* standard output when there is no file; the console also gets one line
+* per point as it completes.
+*/
+//@{
+
+#define BENCH_WARMUP_NS     500000000ull
+#define BENCH_LIST_MAX      16
+#define BENCH_CONTROL_MAX   1024    // loop back buffer of the firmware
+
+struct bench_type {
+	const char *name;
+	int (*round_trip)(usb_dev_handle *handle, uint8_t *out, uint8_t *in, int size, unsigned timeout);
+	int (*available)(int size);
+};
+
+struct bench_point {
+	const struct bench_type *type;
+	int size;
+	int depth;
+	int skipped;
+	struct lat_hist rtt;
+	uint64_t transfers;
+	uint64_t bytes;
+	unsigned long errors;
+	uint64_t elapsed_ns;
+	uint64_t cpu_ns;
+};
+
+struct bench_lane {
+	pthread_t thread;
+	usb_dev_handle *handle;
+	struct bench_point *point;
+	uint8_t *buf_out;
+	uint8_t *buf_in;
+	struct lat_hist rtt;
+	struct rto rto;
+	uint64_t transfers;
+	uint64_t bytes;
+	unsigned long errors;
+};
+
+// raw_ns() bounds of the counted part of the running point
+static _Atomic uint64_t bench_count_ns;
+static _Atomic uint64_t bench_end_ns;
+
+//@}
+
+static int bench_interrupt(usb_dev_handle *handle, uint8_t *out, uint8_t *in, int size, unsigned timeout)
+{
+	int ret;
+
+	if (0> (ret = usb_interrupt_write(handle, udi_vendor_ep_interrupt_out, (char *)out, size, timeout)))
+		return ret;
+	return usb_interrupt_read(handle, udi_vendor_ep_interrupt_in, (char *)in, size, timeout);
+}
+
+static int bench_bulk(usb_dev_handle *handle, uint8_t *out, uint8_t *in, int size, unsigned timeout)
+{
+	int ret;
+
+	if (0> (ret = usb_bulk_write(handle, udi_vendor_ep_bulk_out, (char *)out, size, timeout)))
+		return ret;
+	return usb_bulk_read(handle, udi_vendor_ep_bulk_in, (char *)in, size, timeout);
+}
+
+static int bench_control(usb_dev_handle *handle, uint8_t *out, uint8_t *in, int size, unsigned timeout)
+{
+	int ret;
+
+	if (0> (ret = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_INTERFACE | USB_ENDPOINT_OUT,
+		UDI_VENDOR_REQUEST_LOOPBACK, 0, 0, (char *)out, size, timeout)))
+		return ret;
+	return usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_INTERFACE | USB_ENDPOINT_IN,
+		UDI_VENDOR_REQUEST_LOOPBACK, 0, 0, (char *)in, size, timeout);
+}
+
+static int bench_has_interrupt(int size)
+{
+	(void)size;
+	return udi_vendor_ep_interrupt_in && udi_vendor_ep_interrupt_out;
+}
+
+static int bench_has_bulk(int size)
+{
+	(void)size;
+	return udi_vendor_ep_bulk_in && udi_vendor_ep_bulk_out;
+}
+
+static int bench_has_control(int size)
+{
+	return size <= BENCH_CONTROL_MAX;
+}
+
+static const struct bench_type bench_types[] = {
+	{ "interrupt", bench_interrupt, bench_has_interrupt },
+	{ "bulk", bench_bulk, bench_has_bulk },
+	{ "control", bench_control, bench_has_control },
+};
+
+// A halt that is not set clears harmlessly
+static void bench_clear_halts(usb_dev_handle *handle)
+{
+	const unsigned char eps[] = { udi_vendor_ep_interrupt_out, udi_vendor_ep_interrupt_in,
+		udi_vendor_ep_bulk_out, udi_vendor_ep_bulk_in };
+	unsigned i;
+
+	for (i = 0; i < sizeof(eps); i++)
+		if (eps[i])
+			usb_clear_halt(handle, eps[i]);
+}
+
+static void *bench_lane_main(void *arg)
+{
+	struct bench_lane *lane = arg;
+	const struct bench_point *point = lane->point;
+	uint64_t count = atomic_load(&bench_count_ns), end = atomic_load(&bench_end_ns);
+	uint64_t start, done;
+	int ret;
+
+	while ((start = raw_ns()) < end) {
+		ret = point->type->round_trip(lane->handle, lane->buf_out, lane->buf_in, point->size,
+			rto_ms(&lane->rto));
+		done = raw_ns();
+		rto_update(&lane->rto, done - start, ret < 0 ? ret : 0);
+		if (ret < 0) {
+			lane->errors++;
+			break;
+		}
+		if (start >= count && done <= end) {
+			lat_hist_add(&lane->rtt, done - start);
+			lane->transfers++;
+			lane->bytes += point->size + ret;
+		}
+	}
+	return NULL;
+}
+
+static void bench_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	while ((now = raw_ns()) < ns) {
+		ts.tv_sec = (ns - now) / 1000000000u;
+		ts.tv_nsec = (ns - now) % 1000000000u;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int bench_point_run(usb_dev_handle *handle, struct bench_point *point, int seconds)
+{
+	struct bench_lane *lanes = calloc(point->depth, sizeof(*lanes));
+	uint64_t count, cpu;
+	int started, i, j;
+
+	if (lanes == NULL) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+	lat_hist_reset(&point->rtt);
+	count = raw_ns() + BENCH_WARMUP_NS;
+	atomic_store(&bench_count_ns, count);
+	atomic_store(&bench_end_ns, count + (uint64_t)seconds * 1000000000u);
+	for (started = 0; started < point->depth; started++) {
+		struct bench_lane *lane = &lanes[started];
+
+		lane->handle = handle;
+		lane->point = point;
+		rto_init(&lane->rto, loop_rto.floor_ms, loop_rto.ceiling_ms);
+		lane->buf_out = malloc(point->size);
+		lane->buf_in = malloc(point->size);
+		if (lane->buf_out == NULL || lane->buf_in == NULL) {
+			free(lane->buf_out);
+			free(lane->buf_in);
+			printf("error: cannot start lane %d\n", started);
+			break;
+		}
+		for (j = 0; j < point->size; j++)
+			lane->buf_out[j] = (uint8_t)j;
+		if (pthread_create(&lane->thread, NULL, bench_lane_main, lane)) {
+			free(lane->buf_out);
+			free(lane->buf_in);
+			printf("error: cannot start lane %d\n", started);
+			break;
+		}
+	}
+	bench_sleep_until(count);
+	cpu = cpu_ns();
+	bench_sleep_until(atomic_load(&bench_end_ns));
+	point->cpu_ns = cpu_ns() - cpu;
+	point->elapsed_ns = (uint64_t)seconds * 1000000000u;
+
+	for (i = 0; i < started; i++) {
+		pthread_join(lanes[i].thread, NULL);
+		free(lanes[i].buf_out);
+		free(lanes[i].buf_in);
+		lat_hist_merge(&point->rtt, &lanes[i].rtt);
+		point->transfers += lanes[i].transfers;
+		point->bytes += lanes[i].bytes;
+		point->errors += lanes[i].errors;
+	}
+	free(lanes);
+	return started < point->depth ? -1 : 0;
+}
+
+// Comma separated positive numbers, the count of them or -1
+static int bench_parse(const char *list, int *values)
+{
+	char *end;
+	int n = 0;
+
+	while (*list) {
+		if (n == BENCH_LIST_MAX)
+			return -1;
+		values[n] = (int)strtol(list, &end, 0);
+		if (end == list || values[n] < 1 || (*end && *end != ','))
+			return -1;
+		n++;
+		list = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+static const struct bench_type *bench_type(const char *name, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(bench_types) / sizeof(bench_types[0]); i++)
+		if (strlen(bench_types[i].name) == len && strncmp(bench_types[i].name, name, len) == 0)
+			return &bench_types[i];
+	return NULL;
+}
+
+static double bench_rate(const struct bench_point *point)
+{
+	return point->elapsed_ns ? point->transfers * 1e9 / point->elapsed_ns : 0;
+}
+
+static double bench_mbps(const struct bench_point *point)
+{
+	return point->elapsed_ns ? point->bytes * 1e3 / point->elapsed_ns : 0;
+}
+
+static double bench_cpu_us(const struct bench_point *point)
+{
+	return point->transfers ? point->cpu_ns / 1e3 / point->transfers : 0;
+}
+
+static double bench_cpu_percent(const struct bench_point *point)
+{
+	return point->elapsed_ns ? point->cpu_ns * 100.0 / point->elapsed_ns : 0;
+}
+
+static void bench_write_csv(FILE *f, const struct bench_point *points, int count)
+{
+	const struct lat_hist *h;
+	int i;
+
+	fprintf(f, "type,size,depth,transfers,transfers_per_s,mbytes_per_s,"
+		"p50_us,p90_us,p99_us,p99_9_us,max_us,cpu_us_per_transfer,cpu_percent,errors\n");
+	for (i = 0; i < count; i++) {
+		if (points[i].skipped)
+			continue;
+		h = &points[i].rtt;
+		fprintf(f, "%s,%d,%d,%llu,%.1f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%.1f,%lu\n",
+			points[i].type->name, points[i].size, points[i].depth,
+			(unsigned long long)points[i].transfers, bench_rate(&points[i]), bench_mbps(&points[i]),
+			lat_hist_percentile(h, 50) / 1e3, lat_hist_percentile(h, 90) / 1e3,
+			lat_hist_percentile(h, 99) / 1e3, lat_hist_percentile(h, 99.9) / 1e3, h->max_ns / 1e3,
+			bench_cpu_us(&points[i]), bench_cpu_percent(&points[i]), points[i].errors);
+	}
+}
+
+static void bench_write_json(FILE *f, const struct bench_point *points, int count, int seconds)
+{
+	const struct lat_hist *h;
+	const char *sep = "";
+	int i;
+
+	fprintf(f, "{\n  \"backend\": \"%s\",\n  \"seconds\": %d,\n  \"warmup_ms\": %llu,\n  \"points\": [",
+		backend->name, seconds, BENCH_WARMUP_NS / 1000000);
+	for (i = 0; i < count; i++) {
+		if (points[i].skipped)
+			continue;
+		h = &points[i].rtt;
+		fprintf(f, "%s\n    { \"type\": \"%s\", \"size\": %d, \"depth\": %d, \"transfers\": %llu, "
+			"\"transfers_per_s\": %.1f, \"mbytes_per_s\": %.3f, "
+			"\"latency_us\": { \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f }, "
+			"\"cpu_us_per_transfer\": %.2f, \"cpu_percent\": %.1f, \"errors\": %lu }",
+			sep, points[i].type->name, points[i].size, points[i].depth,
+			(unsigned long long)points[i].transfers, bench_rate(&points[i]), bench_mbps(&points[i]),
+			lat_hist_percentile(h, 50) / 1e3, lat_hist_percentile(h, 90) / 1e3,
+			lat_hist_percentile(h, 99) / 1e3, lat_hist_percentile(h, 99.9) / 1e3, h->max_ns / 1e3,
+			bench_cpu_us(&points[i]), bench_cpu_percent(&points[i]), points[i].errors);
+		sep = ",";
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+static int bench_write(const char *output, const struct bench_point *points, int count, int seconds)
+{
+	size_t len = output ? strlen(output) : 0;
+	int json = len > 5 && strcmp(output + len - 5, ".json") == 0;
+	FILE *f = output ? fopen(output, "w") : stdout;
+
+	if (f == NULL) {
+		printf("error: cannot write %s: %s\n", output, strerror(errno));
+		return -1;
+	}
+	if (json)
+		bench_write_json(f, points, count, seconds);
+	else
+		bench_write_csv(f, points, count);
+	if (f != stdout && fclose(f) != 0) {
+		printf("error: cannot write %s: %s\n", output, strerror(errno));
+		return -1;
+	}
+	if (output)
+		printf("Results written to %s\n", output);
+	return 0;
+}
+
+int bench_run(usb_dev_handle *handle, const char *types, const char *sizes, const char *depths,
+	int seconds, const char *output)
+{
+	const struct bench_type *type_list[BENCH_LIST_MAX];
+	int size_list[BENCH_LIST_MAX], depth_list[BENCH_LIST_MAX];
+	int ntypes = 0, nsizes, ndepths, count = 0, failed = 0, t, s, d;
+	struct bench_point *points, *point;
+	const char *p, *comma;
+
+	for (p = types; *p; p = *comma ? comma + 1 : comma) {
+		comma = strchr(p, ',');
+		if (comma == NULL)
+			comma = p + strlen(p);
+		if (ntypes == BENCH_LIST_MAX || (type_list[ntypes++] = bench_type(p, comma - p)) == NULL) {
+			printf("error: unknown endpoint type in %s\n", types);
+			return -1;
+		}
+	}
+	nsizes = bench_parse(sizes, size_list);
+	ndepths = bench_parse(depths, depth_list);
+	if (ntypes < 1 || nsizes < 1 || ndepths < 1 || seconds < 1) {
+		printf("error: types, sizes, depths and duration must be given and positive\n");
+		return -1;
+	}
+	points = calloc(ntypes * nsizes * ndepths, sizeof(*points));
+	if (points == NULL) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	printf("Benchmark, %d points, %.1f s warm-up and %d s each\n",
+		ntypes * nsizes * ndepths, BENCH_WARMUP_NS / 1e9, seconds);
+	for (t = 0; t < ntypes; t++) {
+		for (s = 0; s < nsizes; s++) {
+			for (d = 0; d < ndepths; d++) {
+				point = &points[count++];
+				point->type = type_list[t];
+				point->size = size_list[s];
+				point->depth = depth_list[d];
+				if (!point->type->available(point->size)) {
+					printf("- %s %d bytes depth %d: skipped, not supported by the device\n",
+						point->type->name, point->size, point->depth);
+					point->skipped = 1;
+					continue;
+				}
+				if (bench_point_run(handle, point, seconds))
+					failed = 1;
+				printf("- %s %d bytes depth %d: %.0f transfers/s, %.3f MB/s, p99 %.1f us, %.2f us CPU per transfer, %lu errors\n",
+					point->type->name, point->size, point->depth, bench_rate(point), bench_mbps(point),
+					lat_hist_percentile(&point->rtt, 99) / 1e3, bench_cpu_us(point), point->errors);
+				if (point->errors) {
+					// A halt left set would fail every later point on the endpoint
+					bench_clear_halts(handle);
+					failed = 1;
+				}
+			}
+		}
+	}
+	if (bench_write(output, points, count, seconds))
+		failed = 1;
+	free(points);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "usbdemo.h"
+#include "stats.h"
+#include "verify.h"
+
+/**
+* Bulk streaming
+*
+* The firmware echoes every bulk OUT buffer on bulk IN. Each direction runs
+* buffers streams, one thread per buffer, so while one transfer completes the
+* next ones are already queued: 2 is double buffering, 3 triple buffering.
+* Only transfers completed before the end of the run are counted.
+*
+* With -V each OUT buffer is sealed with its CRC32C and each full IN buffer
+* checked against its own trailer. That holds only while an IN transfer gets
+* exactly one OUT buffer back: a buffer larger than the firmware's echo
+* buffer comes back split, and several streams per direction may complete
+* out of order and read an echo across two writes. -V therefore takes one
+* buffer per direction of at most BULK_VERIFY_MAX bytes.
+*/
+//@{
+
+#define BULK_VERIFY_MAX     16384   // bulk echo buffer of the firmware
+
+struct stream {
+	pthread_t thread;
+	usb_dev_handle *handle;
+	unsigned char ep;
+	int size;
+	uint8_t *buf;
+	uint64_t end_ns;
+	uint64_t bytes;
+	uint64_t pattern;         // verify_fill() state of a writer
+	unsigned long errors;
+	unsigned long verified;
+	unsigned long corrupt;
+};
+
+//@}
+
+static void *stream_main(void *arg)
+{
+	struct stream *stream = arg;
+	int dir_in = (stream->ep & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
+	int verify = verify_pattern && stream->size > VERIFY_SEAL_SIZE;
+	int ret;
+
+	while (now_ns() < stream->end_ns) {
+		if (dir_in)
+			ret = usb_bulk_read(stream->handle, stream->ep, (char *)stream->buf, stream->size, 1000);
+		else {
+			if (verify)
+				verify_seal(stream->buf, stream->size, &stream->pattern);
+			ret = usb_bulk_write(stream->handle, stream->ep, (char *)stream->buf, stream->size, 1000);
+		}
+		if (now_ns() >= stream->end_ns)
+			break;
+		if (ret < 0) {
+			stream->errors++;
+			break;
+		}
+		stream->bytes += ret;
+		// A short read holds no whole buffer to check
+		if (verify && dir_in && ret == stream->size) {
+			stream->verified++;
+			if (verify_sealed(stream->buf, ret))
+				stream->corrupt++;
+		}
+	}
+	return NULL;
+}
+
+static int stream_start(struct stream *stream, usb_dev_handle *handle, unsigned char ep,
+	int size, uint64_t end_ns)
+{
+	int i;
+
+	stream->handle = handle;
+	stream->ep = ep;
+	stream->size = size;
+	stream->end_ns = end_ns;
+	stream->pattern = ep + (uintptr_t)stream;
+	stream->buf = malloc(size);
+	if (stream->buf == NULL)
+		return -1;
+	for (i = 0; i < size; i++)
+		stream->buf[i] = i;
+	if (pthread_create(&stream->thread, NULL, stream_main, stream)) {
+		free(stream->buf);
+		stream->buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int bulk_run(usb_dev_handle *handle, int size, int buffers, int seconds)
+{
+	struct stream *streams;
+	uint64_t start, bytes_out = 0, bytes_in = 0;
+	unsigned long errors = 0, verified = 0, corrupt = 0;
+	int i, failed = 0;
+
+	if (size < 1 || buffers < 1 || seconds < 1) {
+		printf("error: size, buffers and duration must be positive\n");
+		return -1;
+	}
+	if (verify_pattern && (size > BULK_VERIFY_MAX || buffers > 1)) {
+		printf("error: -V in bulk mode needs -q 1 and -s %d or less\n", BULK_VERIFY_MAX);
+		return -1;
+	}
+	streams = calloc(2 * buffers, sizeof(*streams));
+	if (streams == NULL) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	printf("Bulk streaming, %d bytes per transfer, %d buffers per direction, %d s\n",
+		size, buffers, seconds);
+	start = now_ns();
+	for (i = 0; i < 2 * buffers; i++) {
+		// Even streams write, odd streams read the echo
+		unsigned char ep = (i & 1) ? udi_vendor_ep_bulk_in : udi_vendor_ep_bulk_out;
+
+		if (stream_start(&streams[i], handle, ep, size, start + seconds * 1000000000ull)) {
+			printf("error: cannot start stream %d\n", i);
+			failed = 1;
+			break;
+		}
+	}
+	for (i = 0; i < 2 * buffers; i++) {
+		if (streams[i].buf == NULL)
+			continue;
+		pthread_join(streams[i].thread, NULL);
+		free(streams[i].buf);
+		if (i & 1)
+			bytes_in += streams[i].bytes;
+		else
+			bytes_out += streams[i].bytes;
+		errors += streams[i].errors;
+		verified += streams[i].verified;
+		corrupt += streams[i].corrupt;
+	}
+	free(streams);
+
+	printf("- OUT: %llu bytes, %.2f MB/s\n", (unsigned long long)bytes_out, bytes_out / 1e6 / seconds);
+	printf("- IN: %llu bytes, %.2f MB/s\n", (unsigned long long)bytes_in, bytes_in / 1e6 / seconds);
+	printf("- Errors: %lu\n", errors);
+	if (verify_pattern)
+		printf("- Verified (%s, crc32c %s): %lu buffers, %lu corrupt\n",
+			verify_name(), crc32c_impl(), verified, corrupt);
+	return (errors || corrupt || failed) ? -1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include "usbdemo.h"
+#include "stats.h"
+
+/**
+* Control endpoint loop back
+*
+* The vendor class firmware stores the data stage of an OUT vendor request
+* on interface 0 and returns it on the next IN vendor request. Each request
+* is timed as a whole, setup, data and status stages included.
+*/
+
+static int control_out(usb_dev_handle *device_handle)
+{
+	return usb_control_msg(device_handle,
+		USB_TYPE_VENDOR | USB_RECIP_INTERFACE | USB_ENDPOINT_OUT,
+		UDI_VENDOR_REQUEST_LOOPBACK, 0, 0,
+		(char *)udi_vendor_buf_out,
+		udi_vendor_buf_size,
+		1000);
+}
+
+static int control_in(usb_dev_handle *device_handle)
+{
+	return usb_control_msg(device_handle,
+		USB_TYPE_VENDOR | USB_RECIP_INTERFACE | USB_ENDPOINT_IN,
+		UDI_VENDOR_REQUEST_LOOPBACK, 0, 0,
+		(char *)udi_vendor_buf_in,
+		udi_vendor_buf_size,
+		1000);
+}
+
+int loop_back_control(usb_dev_handle *device_handle)
+{
+	if (0> control_out(device_handle)) {
+		return -1;
+	}
+	if (0> control_in(device_handle)) {
+		return -1;
+	}
+	return 0;
+}
+
+int control_run(usb_dev_handle *handle, int seconds)
+{
+	struct lat_stats lat_out, lat_in, rtt, rtt_interrupt;
+	unsigned long errors = 0;
+	uint64_t end, t0, t1, t2;
+
+	if (seconds < 1) {
+		printf("error: duration must be positive\n");
+		return -1;
+	}
+	lat_reset(&lat_out);
+	lat_reset(&lat_in);
+	lat_reset(&rtt);
+	lat_reset(&rtt_interrupt);
+
+	printf("Control loop back, %d bytes, %d s\n", udi_vendor_buf_size, seconds);
+	end = now_ns() + seconds * 1000000000ull;
+	while (now_ns() < end) {
+		t0 = now_ns();
+		if (0> control_out(handle)) {
+			errors++;
+			break;
+		}
+		t1 = now_ns();
+		if (0> control_in(handle)) {
+			errors++;
+			break;
+		}
+		t2 = now_ns();
+		lat_add(&lat_out, t1 - t0);
+		lat_add(&lat_in, t2 - t1);
+		lat_add(&rtt, t2 - t0);
+	}
+
+	// Same payload over the interrupt endpoints for comparison
+	if (udi_vendor_ep_interrupt_in && udi_vendor_ep_interrupt_out) {
+		printf("Interrupt loop back, %d bytes, %d s\n", udi_vendor_buf_size, seconds);
+		end = now_ns() + seconds * 1000000000ull;
+		while (now_ns() < end) {
+			t0 = now_ns();
+			if (loop_back_interrupt(handle)) {
+				errors++;
+				break;
+			}
+			lat_add(&rtt_interrupt, now_ns() - t0);
+		}
+	}
+
+	printf("- Control requests: %llu OUT, %llu IN, errors: %lu\n",
+		(unsigned long long)lat_out.count, (unsigned long long)lat_in.count, errors);
+	lat_print("Control OUT", &lat_out);
+	lat_print("Control IN", &lat_in);
+	lat_print("Control round trip", &rtt);
+	lat_print("Interrupt round trip", &rtt_interrupt);
+	return errors ? -1 : 0;
+}
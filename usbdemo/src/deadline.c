@@ -0,0 +1,138 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include "deadline.h"
+
+uint64_t sched_interrupt_interval(unsigned binterval, int high_speed)
+{
+	if (binterval == 0)
+		return 0;
+	// Full and low speed: frames of 1 ms. Unknown speed takes the finer
+	// high speed grid, which a full speed device merely holds up
+	if (high_speed == 0)
+		return binterval * 1000000ull;
+	return 125000ull << ((binterval > 16 ? 16 : binterval) - 1);
+}
+
+uint64_t sched_align(uint64_t period_ns, uint64_t interval_ns)
+{
+	if (interval_ns == 0)
+		return period_ns;
+	if (period_ns < interval_ns)
+		return interval_ns;
+	return (period_ns + interval_ns - 1) / interval_ns * interval_ns;
+}
+
+int sched_start(struct sched *s, uint64_t period_ns)
+{
+	memset(s, 0, sizeof(*s));
+	s->period_ns = period_ns ? period_ns : 1;
+	s->start_ns = now_ns();
+	s->next_ns = s->start_ns + s->period_ns;
+	s->timer_fd = -1;
+	lat_reset(&s->late);
+#ifdef __linux__
+	// The default 50 us of timer slack would be most of a sub-millisecond period
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+	s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->timer_fd >= 0) {
+		struct itimerspec its;
+
+		its.it_value.tv_sec = s->next_ns / 1000000000u;
+		its.it_value.tv_nsec = s->next_ns % 1000000000u;
+		its.it_interval.tv_sec = s->period_ns / 1000000000u;
+		its.it_interval.tv_nsec = s->period_ns % 1000000000u;
+		if (timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+			close(s->timer_fd);
+			s->timer_fd = -1;
+		}
+	}
+#endif
+	s->running = 1;
+	return 0;
+}
+
+// Block until the deadline or fd, 1 when fd is readable
+static int sched_block(struct sched *s, int fd)
+{
+	struct timespec ts;
+	int ret;
+
+	if (s->timer_fd >= 0) {
+		struct pollfd pfd[2] = { { s->timer_fd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+		uint64_t expirations;
+
+		ret = poll(pfd, fd >= 0 ? 2 : 1, -1);
+		if (ret < 0)
+			return errno == EINTR ? 0 : -1;
+		if (pfd[0].revents & POLLIN) {
+			// Drained only, the grid position comes from the clock
+			if (read(s->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				return -1;
+		}
+		return fd >= 0 && (pfd[1].revents & POLLIN) ? 1 : 0;
+	}
+	ts.tv_sec = s->next_ns / 1000000000u;
+	ts.tv_nsec = s->next_ns % 1000000000u;
+	ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	return ret == 0 || ret == EINTR ? 0 : -1;
+}
+
+int sched_wait(struct sched *s, int fd)
+{
+	uint64_t now = now_ns(), skipped;
+	int ret;
+
+	// The last tick overran: drop the grid points already gone
+	if (now >= s->next_ns + s->period_ns) {
+		skipped = (now - s->next_ns) / s->period_ns;
+		s->missed += skipped;
+		s->next_ns += skipped * s->period_ns;
+	}
+	while (now < s->next_ns) {
+		if ((ret = sched_block(s, fd)) != 0)
+			return ret;
+		now = now_ns();
+	}
+	lat_add(&s->late, now - s->next_ns);
+	s->drift_ns = now - s->next_ns;
+	s->ticks++;
+	s->next_ns += s->period_ns;
+	return 0;
+}
+
+void sched_stop(struct sched *s)
+{
+	if (s->timer_fd >= 0)
+		close(s->timer_fd);
+	s->timer_fd = -1;
+	s->running = 0;
+}
+
+void sched_print(const struct sched *s)
+{
+	double seconds = (now_ns() - s->start_ns) / 1e9;
+
+	printf("Schedule: %.1f us period (%s), %llu ticks in %.1f s, %llu missed deadlines\n",
+		s->period_ns / 1e3, s->timer_fd >= 0 ? "timerfd" : "clock_nanosleep",
+		(unsigned long long)s->ticks, seconds, (unsigned long long)s->missed);
+	if (s->late.count) {
+		lat_print("Wakeup lateness", &s->late);
+		printf("- Jitter: %.1f us, drift: %.1f us after %.1f s\n",
+			(s->late.max_ns - s->late.min_ns) / 1e3, s->drift_ns / 1e3, seconds);
+	}
+}
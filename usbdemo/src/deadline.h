@@ -0,0 +1,51 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+/**
+* Deadline scheduler
+*
+* Ticks on the absolute grid start + n * period, so the time spent in a
+* transfer or a late wakeup never shifts the following deadlines and the
+* long-run rate does not drift. A deadline that passed a whole period ago is
+* skipped and counted as missed rather than caught up with in a burst.
+*/
+//@{
+
+struct sched {
+	uint64_t period_ns;
+	uint64_t start_ns;
+	uint64_t next_ns;       // deadline of the next tick
+	uint64_t ticks;         // deadlines served
+	uint64_t missed;        // deadlines skipped
+	int64_t drift_ns;       // last wakeup against its grid point
+	struct lat_stats late;  // wakeup minus deadline
+	int timer_fd;           // timerfd on the grid, -1: clock_nanosleep
+	int running;
+};
+
+//@}
+
+// Service interval of an interrupt endpoint from its bInterval, 0 when
+// unknown. high_speed: 1 high speed or faster, 0 full or low speed, -1 unknown
+uint64_t sched_interrupt_interval(unsigned binterval, int high_speed);
+
+// Round period up to a whole number of endpoint service intervals
+uint64_t sched_align(uint64_t period_ns, uint64_t interval_ns);
+
+// First deadline one period from now
+int sched_start(struct sched *s, uint64_t period_ns);
+
+/**
+* Wait for the next deadline. Returns 0 on the deadline, 1 when fd (-1:
+* none) became readable first and -1 on error. Waiting on fd needs the
+* timerfd, with clock_nanosleep only the deadline ends the wait.
+*/
+int sched_wait(struct sched *s, int fd);
+
+void sched_stop(struct sched *s);
+void sched_print(const struct sched *s);
+
+#endif
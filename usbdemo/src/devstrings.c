@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include "usbdemo.h"
+
+/**
+* String descriptor cache
+*
+* Opening a device only records where its strings are. They are read with
+* backend->get_string() the first time something prints them, and kept per
+* device identity (bus path, device number and bcdDevice), so a device that
+* is opened again without re-enumerating, after a reset or a recovery,
+* costs no control requests at all. Every enumeration hands out a new
+* device number, so another board with the same firmware plugged into the
+* same port never gets the strings, and the serial number, of the last one.
+*/
+//@{
+
+#define DEVSTRINGS_MAX 16
+
+struct devstrings {
+	char path[32];
+	int devnum;
+	uint16_t bcd;
+	uint8_t index[DEVSTRING_COUNT];
+	uint8_t fetched;                    // one bit per string
+	char value[DEVSTRING_COUNT][100];
+};
+
+static struct devstrings devstrings_cache[DEVSTRINGS_MAX];
+static int devstrings_used;
+static int devstrings_next;             // slot replaced when the cache is full
+static struct devstrings *devstrings_current;
+
+//@}
+
+void devstrings_attach(const char *path, int devnum, uint16_t bcd, const uint8_t index[DEVSTRING_COUNT])
+{
+	struct devstrings *d;
+	int i;
+
+	for (i = 0; i < devstrings_used; i++) {
+		d = &devstrings_cache[i];
+		if (d->devnum == devnum && d->bcd == bcd && strcmp(d->path, path) == 0
+			&& memcmp(d->index, index, sizeof(d->index)) == 0) {
+			devstrings_current = d;
+			return;
+		}
+	}
+	if (devstrings_used < DEVSTRINGS_MAX) {
+		d = &devstrings_cache[devstrings_used++];
+	}
+	else {
+		d = &devstrings_cache[devstrings_next];
+		devstrings_next = (devstrings_next + 1) % DEVSTRINGS_MAX;
+	}
+	memset(d, 0, sizeof(*d));
+	snprintf(d->path, sizeof(d->path), "%s", path);
+	d->devnum = devnum;
+	d->bcd = bcd;
+	memcpy(d->index, index, sizeof(d->index));
+	devstrings_current = d;
+}
+
+void devstrings_detach(void)
+{
+	devstrings_current = NULL;
+}
+
+const char *devstring(int which)
+{
+	struct devstrings *d = devstrings_current;
+
+	if (d == NULL || which < 0 || which >= DEVSTRING_COUNT || d->index[which] == 0)
+		return NULL;
+	if (!(d->fetched & (1 << which))) {
+		if (!backend->is_open() || backend->get_string(d->index[which], d->value[which], sizeof(d->value[which])) < 0)
+			return NULL;
+		d->fetched |= 1 << which;
+	}
+	return d->value[which];
+}
+
+void devstrings_print(void)
+{
+	const char *s;
+
+	if ((s = devstring(DEVSTRING_MANUFACTURER)) != NULL)
+		printf("- Manufacturer name: %s\n", s);
+	if ((s = devstring(DEVSTRING_PRODUCT)) != NULL)
+		printf("- Product name: %s\n", s);
+	if ((s = devstring(DEVSTRING_SERIAL)) != NULL)
+		printf("- Serial number: %s\n", s);
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "usbdemo.h"
+#include "ring.h"
+#include "stats.h"
+
+/**
+* Full-duplex interrupt I/O
+*
+* A writer thread keeps the interrupt OUT endpoint busy while a reader
+* thread keeps draining the interrupt IN endpoint, so data the device sends
+* on its own is picked up without waiting for an OUT transfer. Each thread
+* publishes its completions into its own lock-free ring, and the main thread
+* folds them into per-direction counters.
+*/
+//@{
+
+#define DUPLEX_RING_SLOTS       1024
+#define DUPLEX_READ_TIMEOUT     100
+
+struct duplex_result {
+	uint64_t lat_ns;  // time spent in the transfer call
+	int status;       // bytes transferred or negative error
+};
+
+struct duplex_side {
+	pthread_t thread;
+	usb_dev_handle *handle;
+	struct ring ring;
+	uint8_t *buf;
+	int size;
+	uint64_t end_ns;
+	unsigned long dropped;  // completions lost to a full ring
+	unsigned long idle;     // reads that timed out with nothing to read
+	int running;
+};
+
+struct duplex_counters {
+	struct lat_stats lat;
+	uint64_t bytes;
+	unsigned long errors;
+};
+
+//@}
+
+static void duplex_publish(struct duplex_side *side, uint64_t lat_ns, int status)
+{
+	struct duplex_result *res = ring_produce(&side->ring);
+
+	if (res == NULL) {
+		side->dropped++;
+		return;
+	}
+	res->lat_ns = lat_ns;
+	res->status = status;
+	ring_produce_commit(&side->ring);
+}
+
+static void *writer_main(void *arg)
+{
+	struct duplex_side *side = arg;
+	uint64_t start;
+	int ret;
+
+	while ((start = now_ns()) < side->end_ns) {
+		ret = usb_interrupt_write(side->handle,
+			udi_vendor_ep_interrupt_out,
+			(char *)side->buf,
+			side->size,
+			1000);
+		duplex_publish(side, now_ns() - start, ret);
+		if (ret < 0)
+			break;
+	}
+	return NULL;
+}
+
+static void *reader_main(void *arg)
+{
+	struct duplex_side *side = arg;
+	uint64_t start;
+	int ret;
+
+	while ((start = now_ns()) < side->end_ns) {
+		ret = usb_interrupt_read(side->handle,
+			udi_vendor_ep_interrupt_in,
+			(char *)side->buf,
+			side->size,
+			DUPLEX_READ_TIMEOUT);
+		if (ret == -ETIMEDOUT) {
+			side->idle++;
+			continue;
+		}
+		duplex_publish(side, now_ns() - start, ret);
+		if (ret < 0)
+			break;
+	}
+	return NULL;
+}
+
+// Fold every completion published so far into the direction's counters
+static void duplex_drain(struct duplex_side *side, struct duplex_counters *c)
+{
+	struct duplex_result *res;
+
+	while ((res = ring_consume(&side->ring)) != NULL) {
+		if (res->status < 0) {
+			c->errors++;
+		}
+		else {
+			c->bytes += res->status;
+			lat_add(&c->lat, res->lat_ns);
+		}
+		ring_consume_commit(&side->ring);
+	}
+}
+
+static void duplex_print(const char *label, const struct duplex_counters *c, const struct duplex_side *side,
+	int seconds)
+{
+	char name[32];
+
+	printf("- %s: %llu transfers (%.1f/s), %.1f kB/s, errors: %lu, ring drops: %lu\n", label,
+		(unsigned long long)c->lat.count, (double)c->lat.count / seconds,
+		c->bytes / 1e3 / seconds, c->errors, side->dropped);
+	snprintf(name, sizeof(name), "%s latency", label);
+	lat_print(name, &c->lat);
+}
+
+int duplex_run(usb_dev_handle *handle, int seconds)
+{
+	struct duplex_side writer, reader;
+	struct duplex_counters out, in;
+	const struct timespec poll = { 0, 1000000 };
+	uint64_t end;
+	int failed = 0, ret = -1;
+
+	if (seconds < 1) {
+		printf("error: duration must be positive\n");
+		return -1;
+	}
+	memset(&writer, 0, sizeof(writer));
+	memset(&reader, 0, sizeof(reader));
+	memset(&out, 0, sizeof(out));
+	memset(&in, 0, sizeof(in));
+	lat_reset(&out.lat);
+	lat_reset(&in.lat);
+	writer.size = reader.size = udi_vendor_buf_size;
+	writer.buf = malloc(writer.size);
+	reader.buf = malloc(reader.size);
+	if (writer.buf == NULL || reader.buf == NULL
+		|| ring_init(&writer.ring, DUPLEX_RING_SLOTS, sizeof(struct duplex_result))
+		|| ring_init(&reader.ring, DUPLEX_RING_SLOTS, sizeof(struct duplex_result))) {
+		printf("error: out of memory\n");
+		goto done;
+	}
+	memcpy(writer.buf, udi_vendor_buf_out, writer.size);
+
+	printf("Full-duplex interrupt I/O, %d bytes, %d s\n", writer.size, seconds);
+	end = now_ns() + seconds * 1000000000ull;
+	writer.handle = reader.handle = handle;
+	writer.end_ns = reader.end_ns = end;
+	writer.running = !pthread_create(&writer.thread, NULL, writer_main, &writer);
+	reader.running = !pthread_create(&reader.thread, NULL, reader_main, &reader);
+	if (!writer.running || !reader.running) {
+		printf("error: cannot start I/O threads\n");
+		failed = 1;
+	}
+
+	while (now_ns() < end) {
+		duplex_drain(&writer, &out);
+		duplex_drain(&reader, &in);
+		nanosleep(&poll, NULL);
+	}
+	if (writer.running)
+		pthread_join(writer.thread, NULL);
+	if (reader.running)
+		pthread_join(reader.thread, NULL);
+	duplex_drain(&writer, &out);
+	duplex_drain(&reader, &in);
+
+	duplex_print("OUT", &out, &writer, seconds);
+	duplex_print("IN", &in, &reader, seconds);
+	printf("- IN idle timeouts: %lu\n", reader.idle);
+	ret = (failed || out.errors || in.errors) ? -1 : 0;
+
+done:
+	ring_free(&writer.ring);
+	ring_free(&reader.ring);
+	free(writer.buf);
+	free(reader.buf);
+	return ret;
+}
@@ -0,0 +1,1117 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <usb.h>
+#include "usbdemo.h"
+
+// const with libusb-compat's usb.h, see configure.ac
+#ifndef USB_WRITE_CONST
+#define USB_WRITE_CONST
+#endif
+
+/**
+* Emulated ASF vendor class device
+*
+* Software stand-in for the 0x03eb/0x2423 board. It implements the subset of
+* the libusb-0.1 API used by usbdemo and ncusbdemo, so linking this file
+* instead of -lusb runs the very same host code against an in-process
+* loopback firmware. Built as libusbemu.so (libtool leaves it in src/.libs)
+* it does the same for a program already linked against libusb-0.1:
+*
+*   LD_PRELOAD=/path/to/src/.libs/libusbemu.so ncusbdemo
+*
+* Only libusb-0.1 calls are emulated; the usb1 and usbfs backends still
+* talk to the real stack.
+*
+* Every transfer written to an OUT endpoint is echoed on the matching IN
+* endpoint. Interrupt endpoints are serviced once per polling interval each,
+* bulk endpoints share one half-duplex bus clock at a fixed bandwidth.
+*
+* Environment:
+* - USBEMU_INTERVAL_US: interrupt polling interval (default 125, one microframe)
+* - USBEMU_BULK_MBPS: bulk bandwidth in MB/s (default 40)
+* - USBEMU_LATENCY_US: firmware service time between receiving an OUT
+*   transfer, or the data stage of a vendor request, and having its echo
+*   ready (default 0)
+* - USBEMU_FIFO: number of 1 KiB buffers the firmware can hold (default 16)
+* - USBEMU_FAULTS: fault profile of the interrupt endpoints, see below
+* - USBEMU_STALL_EVERY: same as stall:N in the fault profile
+* - USBEMU_DEVICES: number of boards on the bus (default 1), each with its
+*   own endpoints, state and serial number
+*
+* Vendor requests on endpoint 0 store the OUT data stage and return it on
+* the next IN request; each stage of a control transfer takes one interval.
+* The configuration and alternate setting belong to the device, not to the
+* handle, and can be read back with GET_CONFIGURATION and GET_INTERFACE.
+* SET_CONFIGURATION additionally takes 1 ms and, like SET_INTERFACE, drops
+* whatever the endpoints held.
+*
+* The fault profile is a list of kind:N entries, separated by commas, blanks
+* or newlines, or @file to read them from a file where # starts a comment.
+* N counts interrupt OUT transfers of a device; when several kinds fall on
+* the same transfer the first one in this list wins:
+* - disconnect:N[:ms]: the device drops off the bus for ms (default 500).
+*   Open handles fail with -ENODEV from then on, the device is missing from
+*   usb_find_devices() meanwhile and comes back unconfigured.
+* - stall:N: the OUT endpoint halts until the halt is cleared.
+* - timeout:N: the transfer is accepted but never echoed.
+* - short:N: only half of the echo comes back.
+* - jitter:us: every echo is ready up to us later, uniformly distributed
+*   and the same sequence on every run.
+* - claim:N: counts interface claims instead, every Nth one of a device
+*   fails with -EBUSY as if another driver held the interface.
+*
+* Isochronous endpoints are only reachable through the libusb-win32
+* asynchronous API, which the emulation provides as well. One packet per
+* interval is sent in each direction; an IN packet with no echo pending
+* completes empty and echoes not picked up in time are overwritten.
+*/
+//@{
+
+#define EMU_EP_INTERRUPT_IN     0x81
+#define EMU_EP_INTERRUPT_OUT    0x02
+#define EMU_EP_BULK_IN          0x83
+#define EMU_EP_BULK_OUT         0x04
+#define EMU_EP_ISO_IN           0x85
+#define EMU_EP_ISO_OUT          0x06
+
+#define EMU_CONTROL_SIZE        64
+#define EMU_INTERRUPT_SIZE      64
+#define EMU_BULK_SIZE           512
+#define EMU_ISO_SIZE            256
+
+#define EMU_LOOPBACK_SIZE       1024
+#define EMU_DEVICES_MAX         64
+#define EMU_FIFO_MAX            256
+#define EMU_ISO_ECHO            16
+
+#define EMU_HALT_OUT            1
+#define EMU_HALT_IN             2
+#define EMU_RESET_NS            10000000 // bus reset and recovery
+#define EMU_SET_CONFIG_NS       1000000  // firmware reinitializing its endpoints
+#define EMU_DISCONNECT_NS       500000000
+#define EMU_PROFILE_MAX         4096
+
+enum { EMU_FAULT_NONE, EMU_FAULT_DISCONNECT, EMU_FAULT_STALL, EMU_FAULT_TIMEOUT, EMU_FAULT_SHORT };
+
+struct emu_faults {
+	unsigned long disconnect_every;
+	uint64_t disconnect_ns;
+	unsigned long stall_every;
+	unsigned long timeout_every;
+	unsigned long short_every;
+	uint64_t jitter_ns;
+	unsigned long claim_every;
+};
+
+struct emu_transfer {
+	int len;
+	int offset;
+	uint64_t ready_ns;
+	uint8_t data[EMU_LOOPBACK_SIZE];
+};
+
+struct emu_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct emu_transfer *fifo;
+	unsigned head;
+	unsigned count;
+	int packet_size;
+	uint64_t packet_ns;     // bus time taken by one packet
+	uint64_t *out_clock;    // next free OUT slot
+	uint64_t *in_clock;     // next free IN slot
+	uint64_t next_out_ns;
+	uint64_t next_in_ns;
+	unsigned halted;        // EMU_HALT_OUT, EMU_HALT_IN
+	// A transfer in progress each way; the host controller runs an endpoint's
+	// transfers one after the other, so their data never interleaves
+	int writing;
+	int reading;
+	unsigned long writes;
+	const struct emu_faults *faults; // NULL: none
+	uint64_t jitter_seed;
+};
+
+struct emu_iso_packet {
+	uint64_t ready_ns;
+	int len;
+	uint8_t data[EMU_ISO_SIZE];
+};
+
+struct emu_iso {
+	pthread_mutex_t lock;
+	uint64_t next_out_ns;
+	uint64_t next_in_ns;
+	struct emu_iso_packet echo[EMU_ISO_ECHO];
+	unsigned head;
+	unsigned count;
+};
+
+struct emu_async {
+	usb_dev_handle *dev;
+	unsigned char ep;
+	int pktsize;
+	char *bytes;
+	int size;
+	int busy;
+	uint64_t start_ns;  // bus slot of the first packet
+	uint64_t done_ns;
+};
+
+struct emu_device {
+	struct usb_device device;   // first, handles point here
+	char serial[20];
+	struct emu_pipe interrupt;
+	struct emu_pipe bulk;
+	uint64_t bulk_bus_ns;
+	struct emu_iso iso;
+	pthread_mutex_t control_lock;
+	uint8_t control_buf[EMU_LOOPBACK_SIZE];
+	int control_len;
+	// Device state, it outlives the handles like on a real device
+	int configuration;
+	int alternate;
+	atomic_ulong claims;        // see claim in the fault profile
+	// Bus presence, see disconnect in the fault profile
+	atomic_uint generation;     // bumped by every disconnect
+	_Atomic uint64_t gone_until_ns;
+	int listed;                 // linked on the bus by usb_find_devices()
+};
+
+struct usb_dev_handle {
+	struct usb_device *device;
+	int interface;
+	unsigned generation;        // of the device when opened
+};
+
+struct usb_bus *usb_busses;
+
+static struct usb_bus emu_bus;
+static struct emu_device *emu_devices;
+static unsigned emu_device_count = 1;
+static struct usb_config_descriptor emu_config;
+static struct usb_interface emu_interface;
+static struct usb_interface_descriptor emu_altsetting[2];
+static struct usb_endpoint_descriptor emu_endpoints[2][6];
+
+static const char *emu_strings[] = {
+	NULL,
+	"ATMEL ASF",
+	"Vendor Class Example",
+	NULL,   // per device
+};
+
+static unsigned emu_fifo_size = 16;
+static uint64_t emu_interval_ns = 125000;
+static uint64_t emu_latency_ns;
+static unsigned emu_bulk_mbps = 40;
+static struct emu_faults emu_faults = { .disconnect_ns = EMU_DISCONNECT_NS };
+static int emu_initialized;
+
+//@}
+
+static struct emu_device *emu_of(usb_dev_handle *dev)
+{
+	return (struct emu_device *)dev->device;
+}
+
+// Handle opened before the device last dropped off the bus
+static int emu_stale(usb_dev_handle *dev)
+{
+	return dev->generation != atomic_load(&emu_of(dev)->generation);
+}
+
+static uint64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void emu_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000u;
+	ts.tv_nsec = ns % 1000000000u;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// Wait on the pipe condition until deadline (0: forever), -ETIMEDOUT on expiry
+static int emu_wait(struct emu_pipe *pipe, uint64_t deadline)
+{
+	struct timespec ts;
+
+	if (deadline == 0)
+		return -pthread_cond_wait(&pipe->cond, &pipe->lock);
+	ts.tv_sec = deadline / 1000000000u;
+	ts.tv_nsec = deadline % 1000000000u;
+	return -pthread_cond_timedwait(&pipe->cond, &pipe->lock, &ts);
+}
+
+static uint64_t emu_deadline(int timeout)
+{
+	return timeout > 0 ? emu_now() + (uint64_t)timeout * 1000000u : 0;
+}
+
+static void emu_pipe_init(struct emu_pipe *pipe, int packet_size, uint64_t packet_ns)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pipe->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pipe->fifo = calloc(emu_fifo_size, sizeof(*pipe->fifo));
+	pipe->packet_size = packet_size;
+	pipe->packet_ns = packet_ns;
+	pipe->out_clock = &pipe->next_out_ns;
+	pipe->in_clock = &pipe->next_in_ns;
+}
+
+static void emu_endpoint(struct usb_endpoint_descriptor *ep, unsigned char address,
+	unsigned char type, unsigned short size, unsigned char interval)
+{
+	ep->bLength = 7;
+	ep->bDescriptorType = USB_DT_ENDPOINT;
+	ep->bEndpointAddress = address;
+	ep->bmAttributes = type;
+	ep->wMaxPacketSize = size;
+	ep->bInterval = interval;
+}
+
+static void emu_build_descriptors(void)
+{
+	int alt;
+
+	for (alt = 0; alt < 2; alt++) {
+		struct usb_endpoint_descriptor *eps = emu_endpoints[alt];
+		// Isochronous endpoints have no bandwidth in alternate setting 0
+		unsigned short iso_size = alt ? EMU_ISO_SIZE : 0;
+
+		emu_endpoint(&eps[0], EMU_EP_INTERRUPT_IN, USB_ENDPOINT_TYPE_INTERRUPT, EMU_INTERRUPT_SIZE, 1);
+		emu_endpoint(&eps[1], EMU_EP_INTERRUPT_OUT, USB_ENDPOINT_TYPE_INTERRUPT, EMU_INTERRUPT_SIZE, 1);
+		emu_endpoint(&eps[2], EMU_EP_BULK_IN, USB_ENDPOINT_TYPE_BULK, EMU_BULK_SIZE, 0);
+		emu_endpoint(&eps[3], EMU_EP_BULK_OUT, USB_ENDPOINT_TYPE_BULK, EMU_BULK_SIZE, 0);
+		emu_endpoint(&eps[4], EMU_EP_ISO_IN, USB_ENDPOINT_TYPE_ISOCHRONOUS, iso_size, 1);
+		emu_endpoint(&eps[5], EMU_EP_ISO_OUT, USB_ENDPOINT_TYPE_ISOCHRONOUS, iso_size, 1);
+
+		emu_altsetting[alt].bLength = 9;
+		emu_altsetting[alt].bDescriptorType = USB_DT_INTERFACE;
+		emu_altsetting[alt].bAlternateSetting = alt;
+		emu_altsetting[alt].bNumEndpoints = 6;
+		emu_altsetting[alt].bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+		emu_altsetting[alt].endpoint = eps;
+	}
+	emu_interface.altsetting = emu_altsetting;
+	emu_interface.num_altsetting = 2;
+
+	emu_config.bLength = 9;
+	emu_config.bDescriptorType = USB_DT_CONFIG;
+	emu_config.bNumInterfaces = 1;
+	emu_config.bConfigurationValue = 1;
+	emu_config.interface = &emu_interface;
+
+	strcpy(emu_bus.dirname, "001");
+}
+
+// One kind:N[:arg] entry of the fault profile, 0 when it is not one
+static int emu_fault_entry(const char *entry)
+{
+	char kind[16];
+	unsigned long n, arg;
+	int fields = sscanf(entry, "%15[a-z]:%lu:%lu", kind, &n, &arg);
+
+	if (fields < 2)
+		return 0;
+	if (strcmp(kind, "disconnect") == 0) {
+		emu_faults.disconnect_every = n;
+		if (fields == 3)
+			emu_faults.disconnect_ns = arg * 1000000ull;
+	}
+	else if (strcmp(kind, "stall") == 0)
+		emu_faults.stall_every = n;
+	else if (strcmp(kind, "timeout") == 0)
+		emu_faults.timeout_every = n;
+	else if (strcmp(kind, "short") == 0)
+		emu_faults.short_every = n;
+	else if (strcmp(kind, "jitter") == 0)
+		emu_faults.jitter_ns = n * 1000ull;
+	else if (strcmp(kind, "claim") == 0)
+		emu_faults.claim_every = n;
+	else
+		return 0;
+	return 1;
+}
+
+static void emu_fault_profile(const char *profile)
+{
+	char text[EMU_PROFILE_MAX], *entry, *save, *comment;
+	size_t len;
+
+	if (profile[0] == '@') {
+		FILE *f = fopen(profile + 1, "r");
+
+		if (f == NULL) {
+			printf("Fault profile %s not readable\n", profile + 1);
+			return;
+		}
+		len = fread(text, 1, sizeof(text) - 1, f);
+		fclose(f);
+		text[len] = '\0';
+		// Comments run to the end of the line
+		while ((comment = strchr(text, '#')) != NULL)
+			memset(comment, ' ', strcspn(comment, "\n"));
+	}
+	else {
+		snprintf(text, sizeof(text), "%s", profile);
+	}
+	for (entry = strtok_r(text, ", \t\r\n", &save); entry; entry = strtok_r(NULL, ", \t\r\n", &save))
+		if (!emu_fault_entry(entry))
+			printf("Fault profile: %s ignored\n", entry);
+}
+
+static void emu_device_init(struct emu_device *emu, unsigned n)
+{
+	struct usb_device *dev = &emu->device;
+
+	dev->descriptor.bLength = 18;
+	dev->descriptor.bDescriptorType = USB_DT_DEVICE;
+	dev->descriptor.bcdUSB = 0x0200;
+	dev->descriptor.bMaxPacketSize0 = 64;
+	dev->descriptor.idVendor = DEVICE_VENDOR_VID;
+	dev->descriptor.idProduct = DEVICE_VENDOR_PID;
+	dev->descriptor.bcdDevice = 0x0100;
+	dev->descriptor.iManufacturer = 1;
+	dev->descriptor.iProduct = 2;
+	dev->descriptor.iSerialNumber = 3;
+	dev->descriptor.bNumConfigurations = 1;
+	dev->config = &emu_config;
+	dev->bus = &emu_bus;
+	dev->devnum = n + 1;
+	snprintf(dev->filename, sizeof(dev->filename), "%03u", n + 1);
+	snprintf(emu->serial, sizeof(emu->serial), "EMU%013u", n + 1);
+
+	emu_pipe_init(&emu->interrupt, EMU_INTERRUPT_SIZE, emu_interval_ns);
+	emu->interrupt.faults = &emu_faults;
+	emu->interrupt.jitter_seed = 0x9e3779b97f4a7c15ull * (n + 1);
+	emu_pipe_init(&emu->bulk, EMU_BULK_SIZE, EMU_BULK_SIZE * 1000u / emu_bulk_mbps);
+	emu->bulk.out_clock = &emu->bulk_bus_ns;
+	emu->bulk.in_clock = &emu->bulk_bus_ns;
+	pthread_mutex_init(&emu->iso.lock, NULL);
+	pthread_mutex_init(&emu->control_lock, NULL);
+}
+
+void usb_init(void)
+{
+	const char *env;
+	unsigned i;
+
+	if (emu_initialized)
+		return;
+	if ((env = getenv("USBEMU_INTERVAL_US")) != NULL)
+		emu_interval_ns = strtoull(env, NULL, 0) * 1000u;
+	if ((env = getenv("USBEMU_LATENCY_US")) != NULL)
+		emu_latency_ns = strtoull(env, NULL, 0) * 1000u;
+	if ((env = getenv("USBEMU_BULK_MBPS")) != NULL)
+		emu_bulk_mbps = strtoul(env, NULL, 0);
+	if (emu_bulk_mbps < 1)
+		emu_bulk_mbps = 40;
+	if ((env = getenv("USBEMU_FIFO")) != NULL)
+		emu_fifo_size = strtoul(env, NULL, 0);
+	if (emu_fifo_size < 1 || emu_fifo_size > EMU_FIFO_MAX)
+		emu_fifo_size = 16;
+
+	if ((env = getenv("USBEMU_DEVICES")) != NULL)
+		emu_device_count = strtoul(env, NULL, 0);
+	if (emu_device_count < 1 || emu_device_count > EMU_DEVICES_MAX)
+		emu_device_count = 1;
+
+	if ((env = getenv("USBEMU_STALL_EVERY")) != NULL)
+		emu_faults.stall_every = strtoul(env, NULL, 0);
+	if ((env = getenv("USBEMU_FAULTS")) != NULL)
+		emu_fault_profile(env);
+
+	emu_build_descriptors();
+	emu_devices = calloc(emu_device_count, sizeof(*emu_devices));
+	if (emu_devices == NULL)
+		return;
+	for (i = 0; i < emu_device_count; i++)
+		emu_device_init(&emu_devices[i], i);
+	emu_initialized = 1;
+	printf("Emulated device %04x:%04x x%u, interval %llu us, latency %llu us, bulk %u MB/s, fifo %u\n",
+		DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, emu_device_count,
+		(unsigned long long)emu_interval_ns / 1000, (unsigned long long)emu_latency_ns / 1000,
+		emu_bulk_mbps, emu_fifo_size);
+	if (emu_faults.disconnect_every || emu_faults.stall_every || emu_faults.timeout_every
+		|| emu_faults.short_every || emu_faults.jitter_ns)
+		printf("Faults every N transfers: disconnect %lu (%llu ms), stall %lu, timeout %lu, short %lu; jitter %llu us\n",
+			emu_faults.disconnect_every, (unsigned long long)emu_faults.disconnect_ns / 1000000,
+			emu_faults.stall_every, emu_faults.timeout_every, emu_faults.short_every,
+			(unsigned long long)emu_faults.jitter_ns / 1000);
+	if (emu_faults.claim_every)
+		printf("Faults every N claims: claim %lu\n", emu_faults.claim_every);
+}
+
+void usb_set_debug(int level)
+{
+	(void)level;
+}
+
+int usb_find_busses(void)
+{
+	if (usb_busses == &emu_bus)
+		return 0;
+	usb_busses = &emu_bus;
+	return 1;
+}
+
+// Links the devices on the bus, returns how many came or went since the last scan
+int usb_find_devices(void)
+{
+	struct usb_device *prev = NULL;
+	uint64_t now = emu_now();
+	int changes = 0;
+	unsigned i;
+
+	if (emu_devices == NULL)
+		return 0;
+	emu_bus.devices = NULL;
+	for (i = 0; i < emu_device_count; i++) {
+		struct emu_device *emu = &emu_devices[i];
+		int present = now >= atomic_load(&emu->gone_until_ns);
+
+		if (present != emu->listed)
+			changes++;
+		emu->listed = present;
+		if (!present)
+			continue;
+		emu->device.prev = prev;
+		emu->device.next = NULL;
+		if (prev)
+			prev->next = &emu->device;
+		else
+			emu_bus.devices = &emu->device;
+		prev = &emu->device;
+	}
+	return changes;
+}
+
+struct usb_bus *usb_get_busses(void)
+{
+	return usb_busses;
+}
+
+struct usb_device *usb_device(usb_dev_handle *dev)
+{
+	return dev->device;
+}
+
+char *usb_strerror(void)
+{
+	return "emulated device error";
+}
+
+usb_dev_handle *usb_open(struct usb_device *dev)
+{
+	usb_dev_handle *handle;
+
+	if (emu_devices == NULL || dev < &emu_devices[0].device
+		|| dev > &emu_devices[emu_device_count - 1].device)
+		return NULL;
+	// Still listed from an older scan, but off the bus
+	if (emu_now() < atomic_load(&((struct emu_device *)dev)->gone_until_ns))
+		return NULL;
+	handle = calloc(1, sizeof(*handle));
+	if (handle == NULL)
+		return NULL;
+	handle->device = dev;
+	handle->interface = -1;
+	handle->generation = atomic_load(&((struct emu_device *)dev)->generation);
+	return handle;
+}
+
+int usb_close(usb_dev_handle *dev)
+{
+	free(dev);
+	return 0;
+}
+
+static void emu_endpoints_reset(struct emu_device *emu);
+
+int usb_set_configuration(usb_dev_handle *dev, int configuration)
+{
+	struct emu_device *emu = emu_of(dev);
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	if (configuration != emu_config.bConfigurationValue)
+		return -EINVAL;
+	emu_endpoints_reset(emu);
+	emu->configuration = configuration;
+	emu->alternate = 0;
+	emu_sleep_until(emu_now() + 2 * emu_interval_ns + EMU_SET_CONFIG_NS);
+	return 0;
+}
+
+int usb_claim_interface(usb_dev_handle *dev, int interface)
+{
+	if (emu_stale(dev))
+		return -ENODEV;
+	if (interface != 0)
+		return -EINVAL;
+	if (emu_faults.claim_every
+		&& (atomic_fetch_add(&emu_of(dev)->claims, 1) + 1) % emu_faults.claim_every == 0)
+		return -EBUSY;
+	dev->interface = interface;
+	return 0;
+}
+
+int usb_release_interface(usb_dev_handle *dev, int interface)
+{
+	if (interface != dev->interface)
+		return -EINVAL;
+	dev->interface = -1;
+	return 0;
+}
+
+int usb_set_altinterface(usb_dev_handle *dev, int alternate)
+{
+	struct emu_device *emu = emu_of(dev);
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	if (dev->interface < 0 || alternate < 0 || alternate >= emu_interface.num_altsetting)
+		return -EINVAL;
+	emu_endpoints_reset(emu);
+	emu->alternate = alternate;
+	emu_sleep_until(emu_now() + 2 * emu_interval_ns);
+	return 0;
+}
+
+int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen)
+{
+	const char *s;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	if (index <= 0 || index >= (int)(sizeof(emu_strings) / sizeof(emu_strings[0])) || buflen == 0)
+		return -EINVAL;
+	s = index == 3 ? emu_of(dev)->serial : emu_strings[index];
+	strncpy(buf, s, buflen - 1);
+	buf[buflen - 1] = '\0';
+	return strlen(buf);
+}
+
+static int emu_packets(int len, int size)
+{
+	return len > 0 ? (len + size - 1) / size : 1;
+}
+
+// Fault the profile puts on the next OUT transfer, called with the pipe locked
+static int emu_fault(struct emu_pipe *pipe)
+{
+	const struct emu_faults *f = pipe->faults;
+	unsigned long n;
+
+	if (f == NULL)
+		return EMU_FAULT_NONE;
+	n = ++pipe->writes;
+	if (f->disconnect_every && n % f->disconnect_every == 0)
+		return EMU_FAULT_DISCONNECT;
+	if (f->stall_every && n % f->stall_every == 0)
+		return EMU_FAULT_STALL;
+	if (f->timeout_every && n % f->timeout_every == 0)
+		return EMU_FAULT_TIMEOUT;
+	if (f->short_every && n % f->short_every == 0)
+		return EMU_FAULT_SHORT;
+	return EMU_FAULT_NONE;
+}
+
+// Extra service time of one echo, xorshift so every run sees the same sequence
+static uint64_t emu_jitter(struct emu_pipe *pipe)
+{
+	uint64_t x = pipe->jitter_seed;
+
+	if (pipe->faults == NULL || pipe->faults->jitter_ns == 0)
+		return 0;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	pipe->jitter_seed = x;
+	return x % (pipe->faults->jitter_ns + 1);
+}
+
+// Queue an OUT transfer for echo, one firmware buffer at a time; -ENODEV
+// when the fault profile takes the device off the bus instead
+static int emu_pipe_write(struct emu_pipe *pipe, const char *bytes, int size, int timeout)
+{
+	uint64_t deadline = emu_deadline(timeout);
+	struct emu_transfer *xfer;
+	uint64_t now, done = 0;
+	int sent = 0, chunk, ret, fault;
+
+	if (size < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pipe->lock);
+	fault = emu_fault(pipe);
+	if (fault == EMU_FAULT_DISCONNECT) {
+		pthread_mutex_unlock(&pipe->lock);
+		return -ENODEV;
+	}
+	if (fault == EMU_FAULT_STALL)
+		pipe->halted |= EMU_HALT_OUT;
+	if (pipe->halted & EMU_HALT_OUT) {
+		pthread_mutex_unlock(&pipe->lock);
+		return -EPIPE;
+	}
+	while (pipe->writing) {
+		if ((ret = emu_wait(pipe, deadline)) == -ETIMEDOUT) {
+			pthread_mutex_unlock(&pipe->lock);
+			return ret;
+		}
+	}
+	pipe->writing = 1;
+	do {
+		while (pipe->count == emu_fifo_size) {
+			if ((ret = emu_wait(pipe, deadline)) == -ETIMEDOUT) {
+				pipe->writing = 0;
+				pthread_cond_broadcast(&pipe->cond);
+				pthread_mutex_unlock(&pipe->lock);
+				return ret;
+			}
+		}
+		chunk = size - sent < EMU_LOOPBACK_SIZE ? size - sent : EMU_LOOPBACK_SIZE;
+		// The OUT packets go out on the next free bus slots
+		now = emu_now();
+		if (*pipe->out_clock < now)
+			*pipe->out_clock = now;
+		*pipe->out_clock += emu_packets(chunk, pipe->packet_size) * pipe->packet_ns;
+		done = *pipe->out_clock;
+		if (fault == EMU_FAULT_TIMEOUT) {
+			// Acknowledged on the bus, lost in the firmware
+			sent += chunk;
+			continue;
+		}
+
+		xfer = &pipe->fifo[(pipe->head + pipe->count) % emu_fifo_size];
+		xfer->len = chunk;
+		if (fault == EMU_FAULT_SHORT) {
+			// Ends in a short packet, so the read stops there
+			xfer->len = chunk / 2;
+			if (xfer->len > 0 && xfer->len % pipe->packet_size == 0)
+				xfer->len--;
+		}
+		xfer->offset = 0;
+		xfer->ready_ns = done + emu_latency_ns + emu_jitter(pipe);
+		memcpy(xfer->data, bytes + sent, xfer->len);
+		pipe->count++;
+		sent += chunk;
+		pthread_cond_broadcast(&pipe->cond);
+	} while (sent < size);
+	pipe->writing = 0;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	emu_sleep_until(done);
+	return size;
+}
+
+// Collect echoed data until the buffer is full or a short packet ends it
+static int emu_pipe_read(struct emu_pipe *pipe, char *bytes, int size, int timeout)
+{
+	uint64_t deadline = emu_deadline(timeout);
+	struct emu_transfer *xfer;
+	uint64_t now, done = 0;
+	int got = 0, len, ret;
+
+	if (size < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->halted & EMU_HALT_IN) {
+		pthread_mutex_unlock(&pipe->lock);
+		return -EPIPE;
+	}
+	while (pipe->reading) {
+		if ((ret = emu_wait(pipe, deadline)) == -ETIMEDOUT) {
+			pthread_mutex_unlock(&pipe->lock);
+			return ret;
+		}
+	}
+	pipe->reading = 1;
+	while (got < size) {
+		while (pipe->count == 0) {
+			if ((ret = emu_wait(pipe, deadline)) == -ETIMEDOUT) {
+				pipe->reading = 0;
+				pthread_cond_broadcast(&pipe->cond);
+				pthread_mutex_unlock(&pipe->lock);
+				if (got == 0)
+					return ret;
+				emu_sleep_until(done);
+				return got;
+			}
+		}
+		xfer = &pipe->fifo[pipe->head];
+		// Not ready in time, the echo stays queued for a later read
+		if (deadline && xfer->ready_ns > deadline) {
+			pipe->reading = 0;
+			pthread_cond_broadcast(&pipe->cond);
+			pthread_mutex_unlock(&pipe->lock);
+			if (got == 0) {
+				emu_sleep_until(deadline);
+				return -ETIMEDOUT;
+			}
+			emu_sleep_until(done);
+			return got;
+		}
+		len = xfer->len - xfer->offset;
+		if (len > size - got)
+			len = size - got;
+		// The echo is sent on the first IN slot after the OUT completed
+		now = emu_now();
+		if (*pipe->in_clock < now)
+			*pipe->in_clock = now;
+		if (*pipe->in_clock < xfer->ready_ns)
+			*pipe->in_clock = xfer->ready_ns;
+		*pipe->in_clock += emu_packets(len, pipe->packet_size) * pipe->packet_ns;
+		done = *pipe->in_clock;
+
+		memcpy(bytes + got, xfer->data + xfer->offset, len);
+		xfer->offset += len;
+		got += len;
+		if (xfer->offset == xfer->len) {
+			int short_packet = xfer->len % pipe->packet_size != 0 || xfer->len == 0;
+
+			pipe->head = (pipe->head + 1) % emu_fifo_size;
+			pipe->count--;
+			pthread_cond_broadcast(&pipe->cond);
+			if (short_packet)
+				break;
+		}
+	}
+	pipe->reading = 0;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	emu_sleep_until(done);
+	return got;
+}
+
+static struct emu_pipe *emu_pipe_for(usb_dev_handle *dev, int ep)
+{
+	struct emu_device *emu = emu_of(dev);
+
+	if (dev->interface < 0 || emu->configuration == 0)
+		return NULL;
+	switch (ep) {
+	case EMU_EP_INTERRUPT_IN:
+	case EMU_EP_INTERRUPT_OUT:
+		return &emu->interrupt;
+	case EMU_EP_BULK_IN:
+	case EMU_EP_BULK_OUT:
+		return &emu->bulk;
+	}
+	return NULL;
+}
+
+// Off the bus for the profile's time: open handles go stale, the device comes back unconfigured
+static void emu_disconnect(struct emu_device *emu)
+{
+	atomic_store(&emu->gone_until_ns, emu_now() + emu_faults.disconnect_ns);
+	atomic_fetch_add(&emu->generation, 1);
+	emu_endpoints_reset(emu);
+	emu->configuration = 0;
+	emu->alternate = 0;
+}
+
+int usb_interrupt_write(usb_dev_handle *dev, int ep, USB_WRITE_CONST char *bytes, int size, int timeout)
+{
+	struct emu_pipe *pipe;
+	int ret;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	pipe = emu_pipe_for(dev, ep);
+	if (pipe != &emu_of(dev)->interrupt || (ep & USB_ENDPOINT_DIR_MASK) != USB_ENDPOINT_OUT)
+		return -EINVAL;
+	ret = emu_pipe_write(pipe, bytes, size, timeout);
+	if (ret == -ENODEV)
+		emu_disconnect(emu_of(dev));
+	return ret;
+}
+
+int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+	struct emu_pipe *pipe;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	pipe = emu_pipe_for(dev, ep);
+	if (pipe != &emu_of(dev)->interrupt || (ep & USB_ENDPOINT_DIR_MASK) != USB_ENDPOINT_IN)
+		return -EINVAL;
+	return emu_pipe_read(pipe, bytes, size, timeout);
+}
+
+int usb_bulk_write(usb_dev_handle *dev, int ep, USB_WRITE_CONST char *bytes, int size, int timeout)
+{
+	struct emu_pipe *pipe;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	pipe = emu_pipe_for(dev, ep);
+
+	if (pipe != &emu_of(dev)->bulk || (ep & USB_ENDPOINT_DIR_MASK) != USB_ENDPOINT_OUT)
+		return -EINVAL;
+	return emu_pipe_write(pipe, bytes, size, timeout);
+}
+
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+	struct emu_pipe *pipe;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	pipe = emu_pipe_for(dev, ep);
+
+	if (pipe != &emu_of(dev)->bulk || (ep & USB_ENDPOINT_DIR_MASK) != USB_ENDPOINT_IN)
+		return -EINVAL;
+	return emu_pipe_read(pipe, bytes, size, timeout);
+}
+
+// CLEAR_FEATURE(ENDPOINT_HALT): one control request without data stage
+int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+	struct emu_pipe *pipe;
+
+	if (emu_stale(dev))
+		return -ENODEV;
+	pipe = emu_pipe_for(dev, ep);
+	if (pipe == NULL)
+		return -EINVAL;
+	pthread_mutex_lock(&pipe->lock);
+	pipe->halted &= (ep & USB_ENDPOINT_DIR_MASK) ? ~EMU_HALT_IN : ~EMU_HALT_OUT;
+	pthread_mutex_unlock(&pipe->lock);
+	emu_sleep_until(emu_now() + 2 * emu_interval_ns);
+	return 0;
+}
+
+int usb_resetep(usb_dev_handle *dev, unsigned int ep)
+{
+	return usb_clear_halt(dev, ep);
+}
+
+// Halts and buffered data of every endpoint are dropped
+static void emu_endpoints_reset(struct emu_device *emu)
+{
+	struct emu_pipe *pipes[] = { &emu->interrupt, &emu->bulk };
+	unsigned i;
+
+	for (i = 0; i < sizeof(pipes) / sizeof(pipes[0]); i++) {
+		pthread_mutex_lock(&pipes[i]->lock);
+		pipes[i]->halted = 0;
+		pipes[i]->count = 0;
+		pthread_cond_broadcast(&pipes[i]->cond);
+		pthread_mutex_unlock(&pipes[i]->lock);
+	}
+	pthread_mutex_lock(&emu->control_lock);
+	emu->control_len = 0;
+	pthread_mutex_unlock(&emu->control_lock);
+}
+
+// Port reset, the host restores configuration and alternate setting
+int usb_reset(usb_dev_handle *dev)
+{
+	if (emu_stale(dev))
+		return -ENODEV;
+	emu_endpoints_reset(emu_of(dev));
+	emu_sleep_until(emu_now() + EMU_RESET_NS);
+	return 0;
+}
+
+// GET_CONFIGURATION and GET_INTERFACE, the standard requests usbdemo sends
+static int emu_standard_request(usb_dev_handle *dev, int requesttype, int request, int index,
+	char *bytes, int size)
+{
+	struct emu_device *emu = emu_of(dev);
+	int recipient = requesttype & 0x1f;
+
+	if (!(requesttype & USB_ENDPOINT_IN) || size < 1)
+		return -EPIPE;
+	if (request == USB_REQ_GET_CONFIGURATION && recipient == USB_RECIP_DEVICE)
+		bytes[0] = emu->configuration;
+	else if (request == USB_REQ_GET_INTERFACE && recipient == USB_RECIP_INTERFACE
+		&& index == 0 && emu->configuration != 0 && dev->interface == 0)
+		bytes[0] = emu->alternate;
+	else
+		return -EPIPE;
+	pthread_mutex_lock(&emu->control_lock);
+	emu_sleep_until(emu_now() + 3 * emu_interval_ns);
+	pthread_mutex_unlock(&emu->control_lock);
+	return 1;
+}
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index,
+	char *bytes, int size, int timeout)
+{
+	struct emu_device *emu = emu_of(dev);
+	int type = requesttype & USB_TYPE_RESERVED;
+	int recipient = requesttype & 0x1f;
+	int len;
+
+	(void)value;
+	(void)timeout;
+	if (emu_stale(dev))
+		return -ENODEV;
+	if (type == USB_TYPE_STANDARD)
+		return emu_standard_request(dev, requesttype, request, index, bytes, size);
+	if (size < 0 || type != USB_TYPE_VENDOR || recipient != USB_RECIP_INTERFACE
+		|| index != 0 || request != 0 || dev->interface < 0)
+		return -EPIPE;
+
+	// Endpoint 0 serves one request at a time: setup, data and status stages
+	pthread_mutex_lock(&emu->control_lock);
+	if (requesttype & USB_ENDPOINT_IN) {
+		len = emu->control_len < size ? emu->control_len : size;
+		memcpy(bytes, emu->control_buf, len);
+	}
+	else {
+		len = size < EMU_LOOPBACK_SIZE ? size : EMU_LOOPBACK_SIZE;
+		memcpy(emu->control_buf, bytes, len);
+		emu->control_len = len;
+	}
+	emu_sleep_until(emu_now() + (2 + emu_packets(len, EMU_CONTROL_SIZE)) * emu_interval_ns + emu_latency_ns);
+	pthread_mutex_unlock(&emu->control_lock);
+	return len;
+}
+
+int usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize)
+{
+	struct emu_async *async;
+
+	// Isochronous endpoints have no bandwidth in alternate setting 0
+	if (dev->interface < 0 || emu_of(dev)->alternate == 0 || pktsize <= 0 || pktsize > EMU_ISO_SIZE
+		|| (ep != EMU_EP_ISO_IN && ep != EMU_EP_ISO_OUT))
+		return -EINVAL;
+	async = calloc(1, sizeof(*async));
+	if (async == NULL)
+		return -ENOMEM;
+	async->dev = dev;
+	async->ep = ep;
+	async->pktsize = pktsize;
+	*context = async;
+	return 0;
+}
+
+int usb_submit_async(void *context, char *bytes, int size)
+{
+	struct emu_async *async = context;
+	struct emu_iso *iso = &emu_of(async->dev)->iso;
+	int packets = emu_packets(size, async->pktsize);
+	uint64_t now = emu_now();
+	int i;
+
+	if (async->busy || size < 0)
+		return -EBUSY;
+	async->bytes = bytes;
+	async->size = size;
+	async->busy = 1;
+
+	pthread_mutex_lock(&iso->lock);
+	if (async->ep == EMU_EP_ISO_OUT) {
+		if (iso->next_out_ns < now)
+			iso->next_out_ns = now;
+		async->start_ns = iso->next_out_ns;
+		iso->next_out_ns += packets * emu_interval_ns;
+		// The firmware echoes each packet from the interval after it arrived
+		for (i = 0; i < packets; i++) {
+			struct emu_iso_packet *pkt;
+			int len = size - i * async->pktsize;
+
+			if (iso->count == EMU_ISO_ECHO) {
+				iso->head = (iso->head + 1) % EMU_ISO_ECHO;
+				iso->count--;
+			}
+			pkt = &iso->echo[(iso->head + iso->count) % EMU_ISO_ECHO];
+			pkt->len = len < async->pktsize ? len : async->pktsize;
+			pkt->ready_ns = async->start_ns + (i + 1) * emu_interval_ns + emu_latency_ns;
+			memcpy(pkt->data, bytes + i * async->pktsize, pkt->len);
+			iso->count++;
+		}
+		async->done_ns = iso->next_out_ns;
+	}
+	else {
+		if (iso->next_in_ns < now)
+			iso->next_in_ns = now;
+		async->start_ns = iso->next_in_ns;
+		iso->next_in_ns += packets * emu_interval_ns;
+		async->done_ns = iso->next_in_ns;
+	}
+	pthread_mutex_unlock(&iso->lock);
+	return 0;
+}
+
+int usb_reap_async(void *context, int timeout)
+{
+	struct emu_async *async = context;
+	struct emu_iso *iso = &emu_of(async->dev)->iso;
+	int packets, i, got = 0;
+
+	if (!async->busy)
+		return -EINVAL;
+	if (timeout > 0 && async->done_ns > emu_deadline(timeout)) {
+		// Still queued, as in libusb-win32, until usb_cancel_async()
+		emu_sleep_until(emu_deadline(timeout));
+		return -ETIMEDOUT;
+	}
+	emu_sleep_until(async->done_ns);
+	async->busy = 0;
+	if (async->ep == EMU_EP_ISO_OUT)
+		return async->size;
+
+	// Each IN packet takes the oldest echo that was ready by its slot
+	packets = emu_packets(async->size, async->pktsize);
+	pthread_mutex_lock(&iso->lock);
+	for (i = 0; i < packets; i++) {
+		struct emu_iso_packet *pkt = &iso->echo[iso->head];
+		int room = async->size - i * async->pktsize;
+		int len;
+
+		if (iso->count == 0 || pkt->ready_ns > async->start_ns + (i + 1) * emu_interval_ns)
+			continue;
+		len = pkt->len < room ? pkt->len : room;
+		memcpy(async->bytes + i * async->pktsize, pkt->data, len);
+		got += len;
+		iso->head = (iso->head + 1) % EMU_ISO_ECHO;
+		iso->count--;
+	}
+	pthread_mutex_unlock(&iso->lock);
+	return got;
+}
+
+int usb_cancel_async(void *context)
+{
+	struct emu_async *async = context;
+
+	async->busy = 0;
+	return 0;
+}
+
+int usb_free_async(void **context)
+{
+	free(*context);
+	*context = NULL;
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include "frame.h"
+
+int frame_stamps;
+
+void frame_reset(struct frame_track *t)
+{
+	atomic_store_explicit(&t->next, 0, memory_order_relaxed);
+	// As if everything before 0 had been seen, the first frame is no gap
+	t->highest = UINT32_MAX;
+	t->window = ~0ull;
+	t->received = t->lost = t->late = t->too_late = t->duplicates = t->foreign = 0;
+	lat_hist_reset(&t->latency);
+}
+
+uint32_t frame_stamp(struct frame_track *t, uint8_t *buf, int len)
+{
+	struct frame_header h;
+
+	h.magic = FRAME_MAGIC;
+	h.seq = atomic_fetch_add_explicit(&t->next, 1, memory_order_relaxed);
+	if (len < FRAME_SIZE)
+		return h.seq;
+	h.sent_ns = raw_ns();
+	memcpy(buf, &h, sizeof(h));
+	return h.seq;
+}
+
+int frame_check(struct frame_track *t, const uint8_t *buf, int len, uint64_t now_ns)
+{
+	struct frame_header h;
+	uint32_t back;
+	int32_t ahead;
+	int ret = FRAME_OK;
+
+	if (len < FRAME_SIZE) {
+		t->foreign++;
+		return FRAME_FOREIGN;
+	}
+	memcpy(&h, buf, sizeof(h));
+	if (h.magic != FRAME_MAGIC) {
+		t->foreign++;
+		return FRAME_FOREIGN;
+	}
+	// Serial number arithmetic, the sequence wraps
+	ahead = (int32_t)(h.seq - t->highest);
+	if (ahead > 0) {
+		t->window = ahead < FRAME_WINDOW ? t->window << ahead | 1 : 1;
+		t->highest = h.seq;
+		if (ahead > 1) {
+			t->lost += ahead - 1;
+			ret = FRAME_GAP;
+		}
+	}
+	else {
+		back = -(uint32_t)ahead;
+		if (back >= FRAME_WINDOW) {
+			t->too_late++;
+			return FRAME_LATE;
+		}
+		if (t->window & 1ull << back) {
+			t->duplicates++;
+			return FRAME_DUP;
+		}
+		t->window |= 1ull << back;
+		t->late++;
+		t->lost--;
+		ret = FRAME_LATE;
+	}
+	t->received++;
+	lat_hist_add(&t->latency, now_ns - h.sent_ns);
+	return ret;
+}
+
+void frame_merge(struct frame_track *dst, const struct frame_track *src)
+{
+	atomic_fetch_add_explicit(&dst->next, atomic_load_explicit(&src->next, memory_order_relaxed),
+		memory_order_relaxed);
+	dst->received += src->received;
+	dst->lost += src->lost;
+	dst->late += src->late;
+	dst->too_late += src->too_late;
+	dst->duplicates += src->duplicates;
+	dst->foreign += src->foreign;
+	lat_hist_merge(&dst->latency, &src->latency);
+}
+
+void frame_print(const char *label, const struct frame_track *t)
+{
+	char hist_label[96];
+
+	printf("- %s: %u sent, %llu received, %llu lost, %llu late, %llu too late, %llu duplicates, %llu foreign\n",
+		label, atomic_load_explicit(&t->next, memory_order_relaxed),
+		(unsigned long long)t->received, (unsigned long long)t->lost, (unsigned long long)t->late,
+		(unsigned long long)t->too_late, (unsigned long long)t->duplicates, (unsigned long long)t->foreign);
+	snprintf(hist_label, sizeof(hist_label), "%s latency", label);
+	lat_hist_print(hist_label, &t->latency);
+}
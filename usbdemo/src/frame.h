@@ -0,0 +1,74 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "stats.h"
+
+/**
+* Framed payloads
+*
+* With -f every OUT buffer starts with a header: a sequence number and the
+* time it was sent. The echo then says by itself which transfer it answers
+* and how long ago that left, so latency is taken straight from it. Loss,
+* duplicates and reordering come from its sequence number against a bitmap
+* of the last 64 numbers received, as in IPsec replay protection. Nothing is
+* looked up per transfer.
+*
+* A number skipped over counts as lost until it turns up late; one more
+* than 64 behind the highest cannot be told from a duplicate any more and
+* counts as too late.
+*/
+//@{
+
+#define FRAME_MAGIC     0x46425355u   // "USBF", tells a frame from other data
+#define FRAME_WINDOW    64
+
+struct frame_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t sent_ns;       // raw_ns() just before the write
+};
+
+#define FRAME_SIZE      ((int)sizeof(struct frame_header))
+
+enum { FRAME_OK, FRAME_GAP, FRAME_LATE, FRAME_DUP, FRAME_FOREIGN };
+
+struct frame_track {
+	atomic_uint next;       // sequence number of the next frame sent, any thread
+	// Receive side, one thread at a time
+	uint32_t highest;       // highest sequence number received
+	uint64_t window;        // bit n: highest - n received
+	uint64_t received;
+	uint64_t lost;
+	uint64_t late;          // arrived after a higher number, filled a gap
+	uint64_t too_late;
+	uint64_t duplicates;
+	uint64_t foreign;       // short, or no frame header
+	struct lat_hist latency;
+};
+
+extern int frame_stamps;    // -f: OUT buffers carry a frame header
+
+//@}
+
+void frame_reset(struct frame_track *t);
+// Header for the next frame at the start of buf, its sequence number;
+// buffers shorter than a header are left alone
+uint32_t frame_stamp(struct frame_track *t, uint8_t *buf, int len);
+// FRAME_* for an echo of len bytes received at now_ns
+int frame_check(struct frame_track *t, const uint8_t *buf, int len, uint64_t now_ns);
+void frame_merge(struct frame_track *dst, const struct frame_track *src);
+void frame_print(const char *label, const struct frame_track *t);
+
+static inline uint32_t frame_seq(const uint8_t *buf)
+{
+	uint32_t seq;
+
+	memcpy(&seq, buf + offsetof(struct frame_header, seq), sizeof(seq));
+	return seq;
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "usbdemo.h"
+#include "stats.h"
+
+// The emulated device sends no uevents, its disconnects would never be seen
+#if defined(HAVE_LINUX_NETLINK_H) && !defined(USBEMU)
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/**
+* Hotplug notification
+*
+* Listens to the kernel uevents on a netlink socket instead of rescanning
+* the busses. Only usb_device events whose PRODUCT matches the vendor device
+* are reported, so the demo loop sleeps in poll() until the device comes or
+* goes and uses no CPU meanwhile.
+*/
+//@{
+
+#define HOTPLUG_GROUP_KERNEL 1
+
+//@}
+
+int hotplug_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = HOTPLUG_GROUP_KERNEL;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Action of a uevent about the vendor device, 0 for any other event
+static int hotplug_parse(const char *msg, int len)
+{
+	char product[32];
+	const char *devpath = NULL;
+	int action = 0, usb_device = 0, match = 0;
+	const char *p;
+
+	snprintf(product, sizeof(product), "PRODUCT=%x/%x/", DEVICE_VENDOR_VID, DEVICE_VENDOR_PID);
+	// "action@devpath" header, then NUL separated KEY=value pairs
+	for (p = msg; p < msg + len; p += strlen(p) + 1) {
+		if (strcmp(p, "ACTION=add") == 0)
+			action = HOTPLUG_ATTACH;
+		else if (strcmp(p, "ACTION=remove") == 0)
+			action = HOTPLUG_DETACH;
+		else if (strcmp(p, "DEVTYPE=usb_device") == 0)
+			usb_device = 1;
+		else if (strncmp(p, "DEVPATH=", 8) == 0)
+			devpath = p + 8;
+		else if (strncmp(p, product, strlen(product)) == 0)
+			match = 1;
+	}
+	if (!usb_device || !action)
+		return 0;
+	// Every device, the index also answers lookups for other serials
+	if (devpath)
+		usbindex_uevent(action, devpath);
+	return match ? action : 0;
+}
+
+int hotplug_wait(int fd, int timeout)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t end = now_ns() + timeout * 1000000ull;
+	char msg[4096];
+	int len, action, ret;
+
+	for (;;) {
+		if (timeout >= 0) {
+			uint64_t now = now_ns();
+
+			// Timeout 0 still reads what is queued
+			ret = poll(&pfd, 1, now < end ? (end - now + 999999) / 1000000 : 0);
+		}
+		else {
+			ret = poll(&pfd, 1, -1);
+		}
+		if (ret == 0)
+			return 0;
+		if (ret < 0)
+			return errno == EINTR ? 0 : -1;
+		len = recv(fd, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+		if (len <= 0)
+			continue;
+		msg[len] = 0;
+		action = hotplug_parse(msg, len);
+		if (action)
+			return action;
+	}
+}
+
+#else
+
+int hotplug_open(void)
+{
+	return -1;
+}
+
+int hotplug_wait(int fd, int timeout)
+{
+	(void)fd;
+	(void)timeout;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "usbdemo.h"
+#include "iso.h"
+
+static void *consumer_main(void *arg)
+{
+	struct iso_consumer *c = arg;
+	const struct timespec idle = { 0, 50000 };
+	struct iso_packet *pkt;
+	uint32_t seq;
+
+	for (;;) {
+		pkt = ring_consume(&c->ring);
+		if (pkt == NULL) {
+			if (atomic_load(&c->stop))
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		lat_add(&c->wait, now_ns() - pkt->t_ns);
+		c->packets++;
+		if (pkt->status >= (int)sizeof(seq)) {
+			memcpy(&seq, pkt->data, sizeof(seq));
+			if (seq > c->next_seq)
+				c->gaps += seq - c->next_seq;
+			if (seq >= c->next_seq)
+				c->next_seq = seq + 1;
+		}
+		ring_consume_commit(&c->ring);
+	}
+	return NULL;
+}
+
+int iso_stream_start(struct iso_stream *s, int pktsize)
+{
+	memset(s, 0, sizeof(*s));
+	s->pktsize = pktsize;
+	if (ring_init(&s->consumer.ring, ISO_RING_SLOTS, sizeof(struct iso_packet) + pktsize)) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+	lat_reset(&s->consumer.wait);
+	atomic_init(&s->consumer.stop, 0);
+	if (pthread_create(&s->consumer.thread, NULL, consumer_main, &s->consumer)) {
+		printf("error: cannot start consumer\n");
+		ring_free(&s->consumer.ring);
+		return -1;
+	}
+	return 0;
+}
+
+void iso_stream_stamp(struct iso_stream *s, uint8_t *buf)
+{
+	memcpy(buf, &s->seq, sizeof(s->seq));
+	s->seq++;
+}
+
+void iso_stream_out(struct iso_stream *s, int status)
+{
+	if (status < 0)
+		s->out_errors++;
+	else
+		s->out_ok++;
+}
+
+void iso_stream_in(struct iso_stream *s, const uint8_t *data, int status)
+{
+	struct iso_packet *pkt;
+	unsigned fill;
+
+	if (status < 0)
+		s->in_errors++;
+	else if (status == 0)
+		s->in_empty++;
+	else if (status < s->pktsize)
+		s->in_short++;
+	else
+		s->in_full++;
+	pkt = ring_produce(&s->consumer.ring);
+	if (pkt == NULL) {
+		s->dropped++;
+	}
+	else {
+		pkt->t_ns = now_ns();
+		pkt->status = status;
+		if (status > 0)
+			memcpy(pkt->data, data, status);
+		ring_produce_commit(&s->consumer.ring);
+	}
+	fill = ring_count(&s->consumer.ring);
+	if (fill > s->max_fill)
+		s->max_fill = fill;
+}
+
+int iso_stream_finish(struct iso_stream *s)
+{
+	atomic_store(&s->consumer.stop, 1);
+	pthread_join(s->consumer.thread, NULL);
+
+	printf("- OUT packets: %lu ok, %lu errors\n", s->out_ok, s->out_errors);
+	printf("- IN packets: %lu full, %lu short, %lu empty, %lu errors\n",
+		s->in_full, s->in_short, s->in_empty, s->in_errors);
+	printf("- Ring: %lu consumed, %lu dropped, max fill %u/%u\n",
+		s->consumer.packets, s->dropped, s->max_fill, s->consumer.ring.mask + 1);
+	printf("- Sequence gaps: %lu\n", s->consumer.gaps);
+	lat_print("Ring wait", &s->consumer.wait);
+	ring_free(&s->consumer.ring);
+	return (s->out_errors || s->in_errors) ? -1 : 0;
+}
+
+#if defined(HAVE_USB_ISOCHRONOUS_SETUP_ASYNC) || defined(USBEMU)
+
+// One libusb-win32 asynchronous context per queued packet
+struct iso_slot {
+	void *context;
+	uint8_t *buf;
+};
+
+static int iso_setup(usb_dev_handle *handle, struct iso_slot *slots, int depth,
+	unsigned char ep, int pktsize)
+{
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		slots[i].buf = calloc(1, pktsize);
+		if (slots[i].buf == NULL)
+			return -1;
+		if (usb_isochronous_setup_async(handle, &slots[i].context, ep, pktsize) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void iso_release(struct iso_slot *slots, int depth)
+{
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		if (slots[i].context) {
+			usb_cancel_async(slots[i].context);
+			usb_free_async(&slots[i].context);
+		}
+		free(slots[i].buf);
+	}
+}
+
+int iso_run(usb_dev_handle *handle, int depth, int seconds)
+{
+	struct iso_slot *out, *in;
+	struct iso_stream stream;
+	uint64_t end;
+	int pktsize = udi_vendor_ep_iso_size;
+	int i, ret, failed = 0, started = 0;
+
+	if (depth < 1 || seconds < 1 || pktsize < (int)sizeof(stream.seq)) {
+		printf("error: bad depth, duration or isochronous packet size\n");
+		return -1;
+	}
+	out = calloc(depth, sizeof(*out));
+	in = calloc(depth, sizeof(*in));
+	if (out == NULL || in == NULL) {
+		printf("error: out of memory\n");
+		free(out);
+		free(in);
+		return -1;
+	}
+	if (iso_setup(handle, out, depth, udi_vendor_ep_iso_out, pktsize)
+		|| iso_setup(handle, in, depth, udi_vendor_ep_iso_in, pktsize)) {
+		printf("error: isochronous setup failed\n");
+		failed = 1;
+		goto done;
+	}
+	if (iso_stream_start(&stream, pktsize)) {
+		failed = 1;
+		goto done;
+	}
+	started = 1;
+
+	printf("Isochronous streaming, %d bytes per packet, %d packets queued per direction, %d s\n",
+		pktsize, depth, seconds);
+	for (i = 0; i < depth; i++) {
+		iso_stream_stamp(&stream, out[i].buf);
+		if (usb_submit_async(out[i].context, (char *)out[i].buf, pktsize) < 0
+			|| usb_submit_async(in[i].context, (char *)in[i].buf, pktsize) < 0) {
+			failed = 1;
+			break;
+		}
+	}
+	end = now_ns() + seconds * 1000000000ull;
+	for (i = 0; !failed && now_ns() < end; i = (i + 1) % depth) {
+		ret = usb_reap_async(out[i].context, 1000);
+		// A timed out context is still queued, it must not be submitted twice
+		if (ret < 0)
+			usb_cancel_async(out[i].context);
+		iso_stream_out(&stream, ret);
+		iso_stream_stamp(&stream, out[i].buf);
+		if (usb_submit_async(out[i].context, (char *)out[i].buf, pktsize) < 0)
+			failed = 1;
+
+		ret = usb_reap_async(in[i].context, 1000);
+		if (ret < 0)
+			usb_cancel_async(in[i].context);
+		iso_stream_in(&stream, in[i].buf, ret);
+		if (usb_submit_async(in[i].context, (char *)in[i].buf, pktsize) < 0)
+			failed = 1;
+	}
+
+done:
+	iso_release(out, depth);
+	iso_release(in, depth);
+	if (started && iso_stream_finish(&stream))
+		failed = 1;
+	free(out);
+	free(in);
+	return failed ? -1 : 0;
+}
+
+#else
+
+int iso_run(usb_dev_handle *handle, int depth, int seconds)
+{
+	(void)handle;
+	(void)depth;
+	(void)seconds;
+	printf("error: isochronous transfers need the libusb-win32 asynchronous API, Linux libusb-0.1 has none; use -b usb1\n");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef ISO_H
+#define ISO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ring.h"
+#include "stats.h"
+
+/**
+* Isochronous streaming
+*
+* depth transfers per direction are kept queued, one packet each so that
+* every packet gets its own status. OUT packets carry a sequence number;
+* completed IN packets are published with their status into a lock-free
+* ring where a consumer thread checks the sequence and measures how long
+* packets wait.
+*
+* The transfers are libusb-1.0 isochronous transfers on the usb1 backend,
+* or the asynchronous API of libusb-win32 (and the emulated device) on
+* usb0; Linux libusb-0.1 has no isochronous transfers at all. Either way
+* they are counted through an iso_stream from one thread, which is also the
+* only producer of the ring.
+*/
+//@{
+
+#define ISO_RING_SLOTS 256
+
+struct iso_packet {
+	uint64_t t_ns;  // reap time
+	int status;     // bytes received or negative error
+	uint8_t data[];
+};
+
+struct iso_consumer {
+	pthread_t thread;
+	struct ring ring;
+	atomic_int stop;
+	struct lat_stats wait;
+	unsigned long packets;
+	unsigned long gaps;
+	uint32_t next_seq;
+};
+
+struct iso_stream {
+	struct iso_consumer consumer;
+	int pktsize;
+	uint32_t seq;           // of the next OUT packet
+	unsigned long out_ok;
+	unsigned long out_errors;
+	unsigned long in_full;
+	unsigned long in_short;
+	unsigned long in_empty;
+	unsigned long in_errors;
+	unsigned long dropped;  // ring full
+	unsigned max_fill;
+};
+
+//@}
+
+// Ring and consumer thread, 0 or -1 with the reason printed
+int iso_stream_start(struct iso_stream *s, int pktsize);
+// Next sequence number into an OUT packet about to be submitted
+void iso_stream_stamp(struct iso_stream *s, uint8_t *buf);
+// Completed OUT packet: bytes sent or negative error
+void iso_stream_out(struct iso_stream *s, int status);
+// Completed IN packet: bytes received or negative error, handed to the consumer
+void iso_stream_in(struct iso_stream *s, const uint8_t *data, int status);
+// Stops the consumer and prints the counters, -1 when packets failed
+int iso_stream_finish(struct iso_stream *s);
+
+#endif
@@ -1,38 +1,190 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
 #include <time.h>
+#include <unistd.h>
 #include <usb.h>
 #include <string.h>
+#include "usbdemo.h"
+#include "stats.h"
+#include "deadline.h"
+#include "verify.h"
+#include "frame.h"
+#include "metrics.h"
 
 /**
 * Device vendor definition
 */
 //@{
 
-#define DEVICE_VENDOR_VID 0x03eb
-#define DEVICE_VENDOR_PID 0x2423
-
 // the device's endpoints
-static unsigned char udi_vendor_ep_interrupt_in;
-static unsigned char udi_vendor_ep_interrupt_out;
-
-char string_usb[100];
+unsigned char udi_vendor_ep_interrupt_in;
+unsigned char udi_vendor_ep_interrupt_out;
+unsigned char udi_vendor_ep_bulk_in;
+unsigned char udi_vendor_ep_bulk_out;
+unsigned char udi_vendor_ep_iso_in;
+unsigned char udi_vendor_ep_iso_out;
+unsigned short udi_vendor_ep_interrupt_size;
+unsigned short udi_vendor_ep_bulk_size;
+unsigned short udi_vendor_ep_iso_size;
+unsigned char udi_vendor_ep_failed;
+unsigned char udi_vendor_ep_interrupt_interval;
+int device_high_speed = -1;
 
 struct usb_bus *bus;
 struct usb_device *device;
 usb_dev_handle *device_handle = NULL; // the device handle
 
-#define  UDI_VENDOR_LOOPBACK_SIZE    12
+const struct backend *backend = &backend_usb0;
+
+// loop back buffers, sized from the interrupt endpoints by init_buffers()
+uint8_t *udi_vendor_buf_out;
+uint8_t *udi_vendor_buf_in;
+int udi_vendor_buf_size;
+
+//@}
+
+/**
+* Command line options
+*/
+//@{
+
+static int opt_depth = 4;    // transfers kept in flight by pipelined modes
+static int opt_seconds = 10; // duration of measurement modes
+static int opt_size = 0;     // bytes per transfer, 0: from wMaxPacketSize
+static int opt_workers = 0;  // multi mode worker threads, 0: one per core
+static long opt_period = 1000000; // demo mode transfer period in us
+static int opt_cpu = -1;     // rt mode CPU, -1: next to the host controller interrupt
+static const char *opt_sizes = "64,512,4096";    // bench mode sweep, -s
+static const char *opt_depths = "1,2,4,8";       // bench mode sweep, -q
+static const char *opt_types = "interrupt,bulk,control";
+static const char *opt_output;                   // bench mode results, NULL: stdout
+static const char *opt_metrics;                  // metrics socket path or port, NULL: none
+int opt_zerocopy = 0;        // transfer buffers mapped from usbfs
+const char *opt_serial;      // serial number of the device to open, NULL: any
+
+//@}
+
+/**
+* Open path
+*/
+//@{
+
+int open_cold;               // always send SET_CONFIGURATION and SET_INTERFACE
+int open_requests;           // of those, sent by the last open
+
+//@}
+
+/**
+* Loop back timeout
+*/
+//@{
 
-uint8_t udi_vendor_buf_out[UDI_VENDOR_LOOPBACK_SIZE] = "hello world";
-uint8_t udi_vendor_buf_in[UDI_VENDOR_LOOPBACK_SIZE];
+struct rto loop_rto;         // from the measured round trips, see rto.c
+static unsigned opt_rto_floor = 5;
+static unsigned opt_rto_ceiling = 1000;
 
 //@}
 
-static void init_buffers(void);
-static int loop_back_interrupt(usb_dev_handle *device_handle);
+// Bytes an endpoint moves per packet, high-bandwidth transactions included
+unsigned short ep_packet_size(unsigned short wMaxPacketSize)
+{
+	return (wMaxPacketSize & 0x7ff) * (1 + ((wMaxPacketSize >> 11) & 3));
+}
+
+static void init_buffers(void)
+{
+	static const char hello[] = "hello world";
+	int size = opt_size ? opt_size : udi_vendor_ep_interrupt_size;
+	int i;
+
+	if (size <= 0)
+		size = UDI_VENDOR_LOOPBACK_SIZE;
+	if (size == udi_vendor_buf_size)
+		return;
+	free(udi_vendor_buf_out);
+	free(udi_vendor_buf_in);
+	udi_vendor_buf_out = malloc(size);
+	udi_vendor_buf_in = calloc(1, size);
+	if (udi_vendor_buf_out == NULL || udi_vendor_buf_in == NULL) {
+		printf("error: cannot allocate %d byte buffers\n", size);
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		udi_vendor_buf_out[i] = i < (int)sizeof(hello) ? hello[i] : (uint8_t)i;
+	udi_vendor_buf_size = size;
+	printf("Transfer size: %d bytes\n", size);
+}
+
+// Record one endpoint of the vendor interface
+void addendpoint(unsigned char ep_type, unsigned char ep_add, unsigned short wMaxPacketSize,
+	unsigned char bInterval)
+{
+	unsigned char dir_in = (ep_add & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
+	unsigned short ep_size = ep_packet_size(wMaxPacketSize);
+
+	switch (ep_type) {
+	case USB_ENDPOINT_TYPE_INTERRUPT:
+		if (dir_in) {
+			udi_vendor_ep_interrupt_in = ep_add;
+		}
+		else {
+			udi_vendor_ep_interrupt_out = ep_add;
+		}
+		udi_vendor_ep_interrupt_size = ep_size;
+		udi_vendor_ep_interrupt_interval = bInterval;
+		break;
+	case USB_ENDPOINT_TYPE_BULK:
+		if (dir_in) {
+			udi_vendor_ep_bulk_in = ep_add;
+		}
+		else {
+			udi_vendor_ep_bulk_out = ep_add;
+		}
+		udi_vendor_ep_bulk_size = ep_size;
+		break;
+	case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+		if (dir_in) {
+			udi_vendor_ep_iso_in = ep_add;
+		}
+		else {
+			udi_vendor_ep_iso_out = ep_add;
+		}
+		udi_vendor_ep_iso_size = ep_size;
+		break;
+	}
+}
+
+// Report the endpoints found and size the buffers to them
+void listendpoints(void)
+{
+	printf("Endpoint in: %02X, out: %02X, size: %d\n", udi_vendor_ep_interrupt_in, udi_vendor_ep_interrupt_out, udi_vendor_ep_interrupt_size);
+	printf("Endpoint bulk in: %02X, out: %02X, size: %d\n", udi_vendor_ep_bulk_in, udi_vendor_ep_bulk_out, udi_vendor_ep_bulk_size);
+	printf("Endpoint iso in: %02X, out: %02X, size: %d\n", udi_vendor_ep_iso_in, udi_vendor_ep_iso_out, udi_vendor_ep_iso_size);
+	init_buffers();
+}
+
+void clearendpoints(void)
+{
+	udi_vendor_ep_interrupt_in = 0;
+	udi_vendor_ep_interrupt_out = 0;
+	udi_vendor_ep_bulk_in = 0;
+	udi_vendor_ep_bulk_out = 0;
+	udi_vendor_ep_iso_in = 0;
+	udi_vendor_ep_iso_out = 0;
+	udi_vendor_ep_interrupt_interval = 0;
+	device_high_speed = -1;
+}
 
-int opendevice(void);
+uint64_t interrupt_interval_ns(void)
+{
+	return sched_interrupt_interval(udi_vendor_ep_interrupt_interval, device_high_speed);
+}
 
 void findendpoint(void)
 {
@@ -56,49 +208,68 @@ void findendpoint(void)
 		}
 		while (nb_ep) {
 			nb_ep--;
-
-			unsigned char ep_type = endpoints[nb_ep].bmAttributes	& USB_ENDPOINT_TYPE_MASK;
-			unsigned char ep_add = endpoints[nb_ep].bEndpointAddress;
-			unsigned char dir_in = (ep_add & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
-			unsigned short ep_size = endpoints[nb_ep].wMaxPacketSize;
-
-			switch (ep_type) {
-			case USB_ENDPOINT_TYPE_INTERRUPT:
-				if (dir_in) {
-					udi_vendor_ep_interrupt_in = ep_add;
-				}
-				else {
-					udi_vendor_ep_interrupt_out = ep_add;
-				}
-				break;
-			}
+			addendpoint(endpoints[nb_ep].bmAttributes & USB_ENDPOINT_TYPE_MASK,
+				endpoints[nb_ep].bEndpointAddress,
+				endpoints[nb_ep].wMaxPacketSize,
+				endpoints[nb_ep].bInterval);
 		}
-		printf("Endpoint in: %02X, out: %02X\n", udi_vendor_ep_interrupt_in, udi_vendor_ep_interrupt_out);
+		listendpoints();
 	//}
 }
 
+// Standard GET_CONFIGURATION/GET_INTERFACE, -1 when the device does not answer
+static int get_state(int recipient, int request)
+{
+	char value;
+
+	if (usb_control_msg(device_handle, USB_ENDPOINT_IN | USB_TYPE_STANDARD | recipient,
+		request, 0, 0, &value, 1, 1000) != 1)
+		return -1;
+	return (unsigned char)value;
+}
+
+// Failed half way through: nothing of the open may stay behind
+static int openinterface_failed(void)
+{
+	usb_close(device_handle);
+	device_handle = NULL;
+	clearendpoints();
+	devstrings_detach();
+	return 0;
+}
+
 int openinterface(void)
 {
+	int alternate = -1;
+
 	//if (opendevice())
 	//{
 		printf("Initialization device\n");
+		open_requests = 0;
 		// Open interface vendor
-		if (usb_set_configuration(device_handle, 1) < 0) {
-			printf("error: setting config 1 failed\n");
-			usb_close(device_handle);
-			return 0;
+		// A device left configured by a previous open is not configured again:
+		// SET_CONFIGURATION drops the state of every endpoint
+		if (open_cold || get_state(USB_RECIP_DEVICE, USB_REQ_GET_CONFIGURATION) != 1) {
+			if (usb_set_configuration(device_handle, 1) < 0) {
+				printf("error: setting config 1 failed\n");
+				return openinterface_failed();
+			}
+			open_requests++;
+			alternate = 0;
 		}
 		if (usb_claim_interface(device_handle, 0) < 0) {
 			printf("error: claiming interface 0 failed\n");
-			usb_close(device_handle);
-			return 0;
+			return openinterface_failed();
 		}
 		if (1 != device->config->interface->num_altsetting) {
-
-			if (usb_set_altinterface(device_handle, 1) < 0) {
-				printf("error: set alternate 1 interface 0 failed\n");
-				usb_close(device_handle);
-				return 0;
+			if (alternate < 0 && !open_cold)
+				alternate = get_state(USB_RECIP_INTERFACE, USB_REQ_GET_INTERFACE);
+			if (alternate != 1) {
+				if (usb_set_altinterface(device_handle, 1) < 0) {
+					printf("error: set alternate 1 interface 0 failed\n");
+					return openinterface_failed();
+				}
+				open_requests++;
 			}
 		}
 		printf("Device ready\n");
@@ -113,32 +284,55 @@ int opendevice(void)
 {
 	if (device_handle == NULL)
 	{
+		struct usbindex_entry entry;
+		int indexed;
+
 		printf("Opening\n");
+		// The sysfs index knows whether a scan can find anything, and where
+		indexed = usbindex_lookup(DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, opt_serial, &entry);
+		if (indexed == 0)
+		{
+			printf("Device not found\n");
+			return 0;
+		}
+		// libusb-0.1 opens only devices it has enumerated, there is no
+		// way around usb_find_devices() even when the index knows the node
 		usb_find_devices(); // find all connected devices
 		// Search and open device
 		for (bus = usb_get_busses(); bus; bus = bus->next)
 		{
+			if (indexed > 0 && atoi(bus->dirname) != entry.busnum)
+				continue;
 			for (device = bus->devices; device; device = device->next)
 			{
-				if (device->descriptor.idVendor == DEVICE_VENDOR_VID && device->descriptor.idProduct == DEVICE_VENDOR_PID)
+				if (indexed > 0 ? atoi(device->filename) == entry.devnum
+					: device->descriptor.idVendor == DEVICE_VENDOR_VID && device->descriptor.idProduct == DEVICE_VENDOR_PID)
 				{
+					const uint8_t strings[DEVSTRING_COUNT] = {
+						device->descriptor.iManufacturer,
+						device->descriptor.iProduct,
+						device->descriptor.iSerialNumber,
+					};
+					char path[32];
+
 					device_handle = usb_open(device);
+					// Gone again between the scan and the open
+					if (device_handle == NULL)
+						continue;
 					printf("Device open\n");
 					printf("- Device version: %d.%d\n", device->descriptor.bcdDevice >> 8, (device->descriptor.bcdDevice & 0xFF));
-					if (0 != device->descriptor.iManufacturer) {
-						usb_get_string_simple(device_handle, device->descriptor.iManufacturer, string_usb, sizeof(string_usb));
-						printf("- Manufacturer name: %s\n", string_usb);
-					}
-					if (0 != device->descriptor.iProduct) {
-						usb_get_string_simple(device_handle, device->descriptor.iProduct, string_usb, sizeof(string_usb));
-						printf("- Product name: %s\n", string_usb);
-					}
-					if (0 != device->descriptor.iSerialNumber) {
-						usb_get_string_simple(device_handle, device->descriptor.iSerialNumber, string_usb, sizeof(string_usb));
-						printf("- Serial number: %s\n\n", string_usb);
-					}
-					openinterface();
-					return 1;
+					// Strings are read when first printed, see devstrings.c
+					if (indexed > 0)
+						snprintf(path, sizeof(path), "%s", entry.path);
+					else
+						snprintf(path, sizeof(path), "%.15s/%.15s", bus->dirname, device->filename);
+					devstrings_attach(path, atoi(device->filename), device->descriptor.bcdDevice, strings);
+					// libusb-0.1 does not tell the speed, sysfs does; a USB 1.x device is full speed
+					if (indexed > 0 && entry.speed)
+						device_high_speed = entry.speed >= 480;
+					else
+						device_high_speed = device->descriptor.bcdUSB < 0x0200 ? 0 : -1;
+					return openinterface();
 				}
 			}
 		}
@@ -151,62 +345,612 @@ int opendevice(void)
 	return 1;
 }
 
+static void print_first_transfer(uint64_t ns)
+{
+	printf("Time to first transfer: %.2f ms, %d set requests (%s path)\n",
+		ns / 1e6, open_requests, open_requests ? "cold" : "fast");
+}
+
+// Round trips of the demo since the device was opened
+static struct lat_hist demo_rtt;
+static unsigned long demo_verified, demo_mismatches;
+static uint64_t demo_pattern;
+static struct frame_track demo_frames;
+static unsigned long demo_stale;  // echoes of an earlier transfer than the last one sent
+
 void transfer(void)
 {
-	if (device_handle != NULL)
+	static int announce; // device strings still to be printed
+	static int opened;   // the device was open before
+	static uint64_t open_ns, print_ns;
+
+	if (!backend->is_open())
 	{
-		if (udi_vendor_ep_interrupt_in && udi_vendor_ep_interrupt_out)
-		{
-			//printf("Interrupt enpoint loop back...\n");
-			if (loop_back_interrupt(device_handle)) {
-				printf("Error during interrupt endpoint transfer\n");
-				usb_close(device_handle);
-				device_handle = NULL;
-				udi_vendor_ep_interrupt_in = 0;
-				udi_vendor_ep_interrupt_out = 0;
-				return;
+		metrics_state(DEVICE_CLOSED);
+		open_ns = now_ns();
+		announce = backend->open();
+		// Straight on to the first transfer instead of waiting a tick
+		if (!announce)
+			return;
+		if (opened)
+			metrics_add(&metrics.reconnects, 1);
+		opened = 1;
+		metrics_state(DEVICE_OPEN);
+		lat_hist_reset(&demo_rtt);
+		demo_verified = demo_mismatches = 0;
+		frame_reset(&demo_frames);
+		demo_stale = 0;
+	}
+	if (udi_vendor_ep_interrupt_in && udi_vendor_ep_interrupt_out)
+	{
+		//printf("Interrupt enpoint loop back...\n");
+		uint64_t start, end;
+		uint32_t seq = 0;
+		int ret;
+
+		if (verify_pattern)
+			verify_fill(udi_vendor_buf_out, udi_vendor_buf_size, &demo_pattern);
+		if (frame_stamps)
+			seq = frame_stamp(&demo_frames, udi_vendor_buf_out, udi_vendor_buf_size);
+		start = raw_ns();
+		ret = backend->loop_back();
+		end = raw_ns();
+		if (ret == 0) {
+			lat_hist_add(&demo_rtt, end - start);
+			metrics_transfer(udi_vendor_buf_size, end - start);
+		}
+		if (ret == 0 && frame_stamps
+			&& frame_check(&demo_frames, udi_vendor_buf_in, udi_vendor_buf_size, end) != FRAME_FOREIGN
+			&& frame_seq(udi_vendor_buf_in) != seq)
+			demo_stale++;
+		if (ret == 0 && verify_pattern) {
+			size_t at = verify_mismatch(udi_vendor_buf_in, udi_vendor_buf_out, udi_vendor_buf_size);
+
+			demo_verified++;
+			if (at != (size_t)udi_vendor_buf_size) {
+				demo_mismatches++;
+				printf("Echo differs at byte %zu: %02X, sent %02X\n", at, udi_vendor_buf_in[at], udi_vendor_buf_out[at]);
 			}
+		}
+		if (ret) {
+			printf("Error during interrupt endpoint transfer: %s\n", strerror(-ret));
+			metrics_error(ret);
+			metrics_state(DEVICE_RECOVERING);
+			ret = recover(ret);
+			metrics_state(backend->is_open() ? DEVICE_OPEN : DEVICE_CLOSED);
+			if (ret)
+				return;
+		}
+		// At most once a second, the schedule may run thousands per second
+		if (announce || now_ns() - print_ns >= 1000000000u) {
 			printf("data: %02X %02X\n", udi_vendor_buf_in[0], udi_vendor_buf_in[1]);
+			print_ns = now_ns();
+		}
+		// Once the first transfer is done, not on the way to it
+		if (announce) {
+			print_first_transfer(now_ns() - open_ns);
+			devstrings_print();
+			announce = 0;
 		}
 	}
-	else
-		opendevice();
 }
 
-/// The main entry-point function.
-int main(int argc, char *argv[])
-{
-
+/**
+* libusb-0.1 backend, blocking transfers on device_handle
+*/
+//@{
 
+static void usb0_init(void)
+{
 	// Libusb initialization
 	printf("Initialization library \"libusb\"...\n");
 	usb_init();         // initialize the library
 	usb_find_busses();  // find all busses
-	printf("Search device...\n");
+}
+
+static int usb0_is_open(void)
+{
+	return device_handle != NULL;
+}
+
+static void usb0_close(void)
+{
+	usb_close(device_handle);
+	device_handle = NULL;
+	clearendpoints();
+	devstrings_detach();
+}
+
+static int usb0_loop_back(void)
+{
+	return loop_back_interrupt(device_handle);
+}
+
+static int usb0_pipeline(int depth, int seconds)
+{
+	return pipeline_run(device_handle, depth, seconds);
+}
+
+static int usb0_iso(int depth, int seconds)
+{
+	return iso_run(device_handle, depth, seconds);
+}
+
+static int usb0_get_string(unsigned char index, char *buf, int size)
+{
+	return usb_get_string_simple(device_handle, index, buf, size);
+}
+
+static int usb0_clear_halt(unsigned char ep)
+{
+	if (usb_clear_halt(device_handle, ep) < 0) {
+		// Older stacks only know the endpoint reset
+		return usb_resetep(device_handle, ep);
+	}
+	return 0;
+}
 
-	while (1)
+static int usb0_reset(void)
+{
+	return usb_reset(device_handle);
+}
+
+const struct backend backend_usb0 = {
+	"usb0", usb0_init, opendevice, usb0_is_open, usb0_close, usb0_loop_back, usb0_pipeline,
+	usb0_get_string, usb0_clear_halt, usb0_reset, usb0_iso, NULL, NULL,
+};
+
+//@}
+
+static const struct backend *backends[] = {
+	&backend_usb0,
+#ifdef HAVE_LIBUSB_1_0
+	&backend_usb1,
+#endif
+#if defined(HAVE_LINUX_USBDEVICE_FS_H) && defined(HAVE_SYS_EPOLL_H) && !defined(USBEMU)
+	&backend_usbfs,
+#endif
+};
+
+// Delay and attempts to open a device that has just been announced
+#define HOTPLUG_RETRY_MS     100
+#define HOTPLUG_RETRIES      10
+// Schedule and round trip statistics while the device stays open
+#define SCHED_REPORT_NS      10000000000ull
+
+static volatile sig_atomic_t demo_stop;
+
+static void demo_signal(int sig)
+{
+	(void)sig;
+	demo_stop = 1;
+}
+
+static void demo_print(const struct sched *sched)
+{
+	sched_print(sched);
+	if (verify_pattern)
+		printf("- Verified (%s): %lu, mismatches: %lu\n", verify_name(), demo_verified, demo_mismatches);
+	if (frame_stamps) {
+		frame_print("Frames", &demo_frames);
+		printf("- Stale echoes: %lu\n", demo_stale);
+	}
+	lat_hist_print("Round trip", &demo_rtt);
+}
+
+// Next transfer on the schedule, HOTPLUG_DETACH when the device went away meanwhile
+static int demo_wait(struct sched *sched, int hotplug)
+{
+	static uint64_t report_ns;
+	int ret;
+
+	if (!sched->running) {
+		uint64_t interval = interrupt_interval_ns();
+		uint64_t period = sched_align(opt_period * 1000ull, interval);
+
+		printf("Transfer period: %.1f us (requested %ld us, interrupt interval %.1f us%s)\n",
+			period / 1e3, opt_period, interval / 1e3, device_high_speed < 0 ? ", speed unknown" : "");
+		sched_start(sched, period);
+		report_ns = sched->start_ns + SCHED_REPORT_NS;
+	}
+	while ((ret = sched_wait(sched, hotplug)) == 1) {
+		if (hotplug_wait(hotplug, 0) == HOTPLUG_DETACH) {
+			printf("Device removed\n");
+			return HOTPLUG_DETACH;
+		}
+	}
+	if (ret < 0) {
+		printf("error: waiting for the next deadline failed\n");
+		sleep(1);
+	}
+	if (now_ns() >= report_ns) {
+		demo_print(sched);
+		report_ns += SCHED_REPORT_NS;
+	}
+	return 0;
+}
+
+static int run_demo(void)
+{
+	struct sched sched = { .running = 0 };
+	struct sigaction sa;
+	int hotplug = hotplug_open();
+	int retries = 0;
+
+	// No SA_RESTART: a blocking wait returns, the statistics get printed on the way out
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = demo_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (hotplug < 0)
+		printf("No hotplug notification, polling once per second\n");
+	else
+		usbindex_track();
+	while (!demo_stop)
 	{
 		transfer();
-		sleep(1);
+		if (!backend->is_open() && sched.running) {
+			demo_print(&sched);
+			sched_stop(&sched);
+		}
+		if (backend->is_open()) {
+			// Deadline scheduled, cut short when the device goes away
+			retries = 0;
+			if (demo_wait(&sched, hotplug) == HOTPLUG_DETACH)
+				backend->close();
+		}
+		else if (hotplug < 0) {
+			sleep(1);
+		}
+		else if (retries > 0) {
+			// udev may still be setting up the device node
+			retries--;
+			hotplug_wait(hotplug, HOTPLUG_RETRY_MS);
+		}
+		else {
+			// Nothing to rescan until the device is plugged in
+			printf("Waiting for device...\n");
+			if (hotplug_wait(hotplug, -1) == HOTPLUG_ATTACH)
+				retries = HOTPLUG_RETRIES;
+		}
+	}
+	if (sched.running) {
+		demo_print(&sched);
+		sched_stop(&sched);
+	}
+	if (backend->is_open())
+		backend->close();
+	return 0;
+}
+
+static int run_pipe(void)
+{
+	if (!backend->open() || !udi_vendor_ep_interrupt_in || !udi_vendor_ep_interrupt_out) {
+		printf("error: no interrupt endpoints\n");
+		return 1;
+	}
+	return backend->pipeline(opt_depth, opt_seconds) ? 1 : 0;
+}
+
+static int run_bulk(void)
+{
+	if (!opendevice() || !udi_vendor_ep_bulk_in || !udi_vendor_ep_bulk_out) {
+		printf("error: no bulk endpoints\n");
+		return 1;
+	}
+	// Default to enough packets per transfer to amortize the per-transfer cost
+	return bulk_run(device_handle, opt_size ? opt_size : 32 * udi_vendor_ep_bulk_size,
+		opt_depth, opt_seconds) ? 1 : 0;
+}
+
+static int run_iso(void)
+{
+	if (backend->iso == NULL) {
+		printf("error: the %s backend has no isochronous transfers\n", backend->name);
+		return 1;
+	}
+	if (!backend->open() || !udi_vendor_ep_iso_in || !udi_vendor_ep_iso_out || !udi_vendor_ep_iso_size) {
+		printf("error: no isochronous endpoints\n");
+		return 1;
 	}
+	return backend->iso(opt_depth, opt_seconds) ? 1 : 0;
+}
 
+static int run_control(void)
+{
+	if (!opendevice()) {
+		return 1;
+	}
+	return control_run(device_handle, opt_seconds) ? 1 : 0;
 }
 
-static int loop_back_interrupt(usb_dev_handle *device_handle)
+static int run_duplex(void)
 {
-	if (0> usb_interrupt_write(device_handle,
+	if (!opendevice() || !udi_vendor_ep_interrupt_in || !udi_vendor_ep_interrupt_out) {
+		printf("error: no interrupt endpoints\n");
+		return 1;
+	}
+	return duplex_run(device_handle, opt_seconds) ? 1 : 0;
+}
+
+static int run_rt(void)
+{
+	if (!backend->open() || !udi_vendor_ep_interrupt_in || !udi_vendor_ep_interrupt_out) {
+		printf("error: no interrupt endpoints\n");
+		return 1;
+	}
+	return rt_run(opt_cpu, opt_seconds) ? 1 : 0;
+}
+
+static int run_recover(void)
+{
+	return recover_run(opt_seconds) ? 1 : 0;
+}
+
+static int run_bench(void)
+{
+	if (!opendevice()) {
+		return 1;
+	}
+	return bench_run(device_handle, opt_types, opt_sizes, opt_depths, opt_seconds, opt_output) ? 1 : 0;
+}
+
+static int run_multi(void)
+{
+	return multi_run(opt_size, opt_workers, opt_seconds) ? 1 : 0;
+}
+
+// Reopen rounds per open path
+#define OPEN_ROUNDS 5
+// Failed opens in a row before open mode gives up
+#define OPEN_RETRIES 3
+
+static int run_open(void)
+{
+	struct lat_stats ttft[2]; // fast, cold
+	unsigned long requests[2] = { 0, 0 };
+	unsigned long failures = 0;
+	uint64_t start;
+	int round, cold, failed = 0;
+
+	if (!backend->open() || !udi_vendor_ep_interrupt_in || !udi_vendor_ep_interrupt_out) {
+		printf("error: no interrupt endpoints\n");
+		return 1;
+	}
+	lat_reset(&ttft[0]);
+	lat_reset(&ttft[1]);
+	for (round = 0; round < 2 * OPEN_ROUNDS; round++) {
+		cold = round & 1;
+		// Not open after a failed round
+		if (backend->is_open())
+			backend->close();
+		open_cold = cold;
+		start = now_ns();
+		if (!backend->open()) {
+			// A failed open leaves nothing behind, the round starts over
+			failures++;
+			if (++failed > OPEN_RETRIES) {
+				printf("error: reopen failed %d times in a row\n", failed);
+				open_cold = 0;
+				return 1;
+			}
+			round--;
+			continue;
+		}
+		failed = 0;
+		if (backend->loop_back()) {
+			printf("error: first transfer after reopen failed\n");
+			open_cold = 0;
+			return 1;
+		}
+		lat_add(&ttft[cold], now_ns() - start);
+		requests[cold] += open_requests;
+		print_first_transfer(now_ns() - start);
+	}
+	open_cold = 0;
+
+	printf("Open path, %d rounds each, %lu failed opens retried\n", OPEN_ROUNDS, failures);
+	printf("- Cold: %.1f set requests per open\n", (double)requests[1] / OPEN_ROUNDS);
+	lat_print("Cold time to first transfer", &ttft[1]);
+	printf("- Fast: %.1f set requests per open\n", (double)requests[0] / OPEN_ROUNDS);
+	lat_print("Fast time to first transfer", &ttft[0]);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+	int any_backend;  // 0: needs the libusb-0.1 device_handle
+	const char *help;
+} modes[] = {
+	{ "demo", run_demo, 1, "interrupt loop back once per second (default)" },
+	{ "pipe", run_pipe, 1, "pipelined interrupt loop back, -q transfers in flight" },
+	{ "bulk", run_bulk, 0, "bulk streaming, -q buffers per direction" },
+	{ "iso", run_iso, 1, "isochronous streaming, -q packets queued per direction (usb1 backend;\n"
+		"           usb0 only with the libusb-win32 API or the emulated device)" },
+	{ "control", run_control, 0, "vendor request loop back on endpoint 0 against interrupt" },
+	{ "duplex", run_duplex, 0, "independent interrupt writer and reader threads" },
+	{ "open", run_open, 1, "time to first transfer, cold against fast open path" },
+	{ "rt", run_rt, 1, "round trip latency, default against SCHED_FIFO/mlockall/pinned" },
+	{ "multi", run_multi, 0, "every device at once on a work-stealing pool, -w workers" },
+	{ "recover", run_recover, 1, "time to recover and lost transfers, see USBEMU_FAULTS" },
+	{ "bench", run_bench, 0, "sweep -e types, -s sizes and -q depths, -t s per point, to -o" },
+};
+
+static void usage(const char *name)
+{
+	unsigned i;
+
+	printf("Usage: %s [-b backend] [-m mode] [-c cpu] [-q depth] [-s size] [-t seconds] [-n serial] [-p period] [-T floor:ceiling] [-w workers] [-e types] [-o file] [-V pattern] [-f] [-M socket|port] [-z]\n", name);
+	printf("  -s size     bytes per transfer, any number of packets\n");
+	printf("              (default: one interrupt packet, 32 bulk packets)\n");
+	printf("  -c cpu      rt mode CPU (default: the one taking the host controller interrupt)\n");
+	printf("  -n serial   open the device with this serial number (needs sysfs)\n");
+	printf("  -p period   demo mode microseconds between transfers, rounded up to the\n");
+	printf("              interrupt endpoint interval (default 1000000)\n");
+	printf("  -T floor:ceiling  loop back timeout bounds in ms (default 5:1000), the\n");
+	printf("              timeout follows the measured round trip time in between\n");
+	printf("  -w workers  multi mode worker threads (default: one per core)\n");
+	printf("  -e types    bench mode endpoint types (default: interrupt,bulk,control);\n");
+	printf("              -s and -q take comma separated lists in bench mode\n");
+	printf("              (default: -s 64,512,4096 -q 1,2,4,8)\n");
+	printf("  -o file     bench mode results, CSV or JSON by extension (default: CSV on stdout)\n");
+	printf("  -V pattern  fill OUT buffers with counter or prbs and check the echoes\n");
+	printf("              (demo, pipe, multi and bulk modes, bulk with -q 1; default: off)\n");
+	printf("  -f          stamp OUT buffers with a sequence number and send time, count\n");
+	printf("              lost, late and duplicate echoes (demo, pipe and multi modes)\n");
+	printf("  -M socket|port  serve demo mode metrics in the Prometheus text format\n");
+	printf("              on a Unix socket path or a TCP port of 127.0.0.1\n");
+	printf("  -z          pipe mode runs again from usbfs mapped buffers and compares\n");
+	printf("              round trip and CPU per transfer with heap buffers (usb1 backend)\n");
+	printf("  -b backend  one of:");
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		printf(" %s", backends[i]->name);
+	printf(" (default: %s)\n", backends[0]->name);
+	printf("Modes:\n");
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		printf("  %-8s %s\n", modes[i].name, modes[i].help);
+}
+
+/// The main entry-point function.
+int main(int argc, char *argv[])
+{
+	const char *mode = "demo";
+	const char *backend_name = backends[0]->name;
+	unsigned i, b;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "b:c:e:fm:M:n:o:p:q:s:t:T:V:w:zh")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend_name = optarg;
+			break;
+		case 'c':
+			opt_cpu = atoi(optarg);
+			break;
+		case 'e':
+			opt_types = optarg;
+			break;
+		case 'f':
+			frame_stamps = 1;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'M':
+			opt_metrics = optarg;
+			break;
+		case 'n':
+			opt_serial = optarg;
+			break;
+		case 'o':
+			opt_output = optarg;
+			break;
+		case 'p':
+			opt_period = atol(optarg);
+			break;
+		case 'q':
+			opt_depth = atoi(optarg);
+			opt_depths = optarg;
+			break;
+		case 's':
+			opt_size = atoi(optarg);
+			opt_sizes = optarg;
+			break;
+		case 't':
+			opt_seconds = atoi(optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u:%u", &opt_rto_floor, &opt_rto_ceiling) < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'V':
+			if ((verify_pattern = verify_parse(optarg)) < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			opt_workers = atoi(optarg);
+			break;
+		case 'z':
+			opt_zerocopy = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		if (strcmp(mode, modes[i].name) == 0)
+			break;
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+		if (strcmp(backend_name, backends[b]->name) == 0)
+			break;
+	if (i == sizeof(modes) / sizeof(modes[0]) || b == sizeof(backends) / sizeof(backends[0])) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (frame_stamps && opt_size && opt_size < FRAME_SIZE) {
+		printf("error: -f needs at least %d bytes per transfer\n", FRAME_SIZE);
+		return 1;
+	}
+	backend = backends[b];
+	if (!modes[i].any_backend && backend != &backend_usb0) {
+		printf("error: mode %s needs the %s backend\n", modes[i].name, backend_usb0.name);
+		return 1;
+	}
+
+	// Only the demo loop counts, other modes would serve zeros
+	if (opt_metrics && modes[i].run != run_demo) {
+		printf("error: -M needs the demo mode\n");
+		return 1;
+	}
+
+	rto_init(&loop_rto, opt_rto_floor, opt_rto_ceiling);
+	verify_init();
+	if (opt_metrics && metrics_start(opt_metrics))
+		return 1;
+	backend->init();
+	printf("Search device...\n");
+
+	ret = modes[i].run();
+	devstrings_print();
+	rto_print(&loop_rto);
+	if (backend->exit)
+		backend->exit();
+	return ret;
+}
+
+int loop_back_interrupt(usb_dev_handle *device_handle)
+{
+	unsigned timeout = rto_ms(&loop_rto);
+	uint64_t start = now_ns(), spent;
+	int ret;
+
+	if (0> (ret = usb_interrupt_write(device_handle,
 		udi_vendor_ep_interrupt_out,
-		udi_vendor_buf_out,
-		sizeof(udi_vendor_buf_out),
-		1000)) {
-		return -1;
+		(char *)udi_vendor_buf_out,
+		udi_vendor_buf_size,
+		timeout))) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_out;
+		goto done;
 	}
-	if (0> usb_interrupt_read(device_handle,
+	// One timeout for the round trip, the read gets what the write left
+	spent = (now_ns() - start) / 1000000;
+	if (0> (ret = usb_interrupt_read(device_handle,
 		udi_vendor_ep_interrupt_in,
-		udi_vendor_buf_in,
-		sizeof(udi_vendor_buf_in),
-		1000)) {
-		return -1;
+		(char *)udi_vendor_buf_in,
+		udi_vendor_buf_size,
+		spent < timeout ? timeout - spent : 1))) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		goto done;
 	}
-	return 0;
+	// Part of the echo went missing, as good as lost
+	ret = ret < udi_vendor_buf_size ? -EREMOTEIO : 0;
+done:
+	rto_update(&loop_rto, now_ns() - start, ret);
+	return ret;
 }
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "metrics.h"
+
+#define METRICS_BODY_SIZE   8192
+#define METRICS_TIMEOUT_S   1       // a stuck scraper holds up only the next one
+
+struct metrics metrics;
+
+static int metrics_fd = -1;
+
+static const char *metrics_error_names[METRIC_ERRORS] = {
+	[METRIC_TIMEOUT] = "timeout",
+	[METRIC_STALL] = "stall",
+	[METRIC_NO_DEVICE] = "no_device",
+	[METRIC_SHORT] = "short",
+	[METRIC_OTHER] = "other",
+};
+
+static const char *metrics_state_names[DEVICE_STATES] = {
+	[DEVICE_CLOSED] = "closed",
+	[DEVICE_OPEN] = "open",
+	[DEVICE_RECOVERING] = "recovering",
+};
+
+static uint64_t metrics_get(atomic_ullong *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Appends to buf, as much as fits
+static void metrics_printf(char *buf, size_t *len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void metrics_printf(char *buf, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (*len >= METRICS_BODY_SIZE)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *len, METRICS_BODY_SIZE - *len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		*len += n;
+	if (*len > METRICS_BODY_SIZE - 1)
+		*len = METRICS_BODY_SIZE - 1;
+}
+
+static size_t metrics_format(char *buf)
+{
+	uint64_t count = 0;
+	size_t len = 0;
+	int i, state;
+
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_transfers_total Interrupt loop backs completed.\n"
+		"# TYPE usbdemo_transfers_total counter\n"
+		"usbdemo_transfers_total %llu\n",
+		(unsigned long long)metrics_get(&metrics.transfers));
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_bytes_total Payload bytes of completed loop backs.\n"
+		"# TYPE usbdemo_bytes_total counter\n"
+		"usbdemo_bytes_total{direction=\"out\"} %llu\n"
+		"usbdemo_bytes_total{direction=\"in\"} %llu\n",
+		(unsigned long long)metrics_get(&metrics.bytes_out),
+		(unsigned long long)metrics_get(&metrics.bytes_in));
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_errors_total Failed loop backs by cause.\n"
+		"# TYPE usbdemo_errors_total counter\n");
+	for (i = 0; i < METRIC_ERRORS; i++)
+		metrics_printf(buf, &len, "usbdemo_errors_total{type=\"%s\"} %llu\n",
+			metrics_error_names[i], (unsigned long long)metrics_get(&metrics.errors[i]));
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_reconnects_total Times the device was opened again after being open.\n"
+		"# TYPE usbdemo_reconnects_total counter\n"
+		"usbdemo_reconnects_total %llu\n",
+		(unsigned long long)metrics_get(&metrics.reconnects));
+
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_round_trip_seconds Interrupt loop back round trip time.\n"
+		"# TYPE usbdemo_round_trip_seconds histogram\n");
+	// Count from the buckets, so the +Inf bucket and _count agree
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		count += metrics_get(&metrics.rtt_buckets[i]);
+		metrics_printf(buf, &len, "usbdemo_round_trip_seconds_bucket{le=\"%.9g\"} %llu\n",
+			(double)(1ull << (METRICS_BUCKET_MIN_BITS + i)) / 1e9, (unsigned long long)count);
+	}
+	count += metrics_get(&metrics.rtt_buckets[METRICS_BUCKETS]);
+	metrics_printf(buf, &len,
+		"usbdemo_round_trip_seconds_bucket{le=\"+Inf\"} %llu\n"
+		"usbdemo_round_trip_seconds_sum %.9f\n"
+		"usbdemo_round_trip_seconds_count %llu\n",
+		(unsigned long long)count, metrics_get(&metrics.rtt_sum_ns) / 1e9, (unsigned long long)count);
+
+	state = atomic_load_explicit(&metrics.state, memory_order_relaxed);
+	metrics_printf(buf, &len,
+		"# HELP usbdemo_device_state Current device state, 1 for the one it is in.\n"
+		"# TYPE usbdemo_device_state gauge\n");
+	for (i = 0; i < DEVICE_STATES; i++)
+		metrics_printf(buf, &len, "usbdemo_device_state{state=\"%s\"} %d\n",
+			metrics_state_names[i], state == i);
+	return len;
+}
+
+static void metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0 && (n = send(fd, buf, len, MSG_NOSIGNAL)) > 0) {
+		buf += n;
+		len -= n;
+	}
+}
+
+// One scrape: read the request up to its blank line, answer, close
+static void metrics_serve(int fd, char *body)
+{
+	struct timeval tv = { .tv_sec = METRICS_TIMEOUT_S };
+	char req[1024], head[128];
+	size_t got = 0, len;
+	ssize_t n;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	// Anything that is not HTTP gets the same answer
+	while (got < sizeof(req) - 1 && (n = recv(fd, req + got, sizeof(req) - 1 - got, 0)) > 0) {
+		got += n;
+		req[got] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+			break;
+	}
+	len = metrics_format(body);
+	snprintf(head, sizeof(head),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"\r\n", len);
+	metrics_send(fd, head, strlen(head));
+	metrics_send(fd, body, len);
+	close(fd);
+}
+
+static void *metrics_main(void *arg)
+{
+	static char body[METRICS_BODY_SIZE];
+	int fd;
+
+	(void)arg;
+	for (;;) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("Metrics: accept: %s\n", strerror(errno));
+			return NULL;
+		}
+		metrics_serve(fd, body);
+	}
+}
+
+static int metrics_listen(const char *address)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct stat st;
+	char *end;
+	long port = strtol(address, &end, 10);
+	int fd;
+
+	if (*address != '\0' && *end == '\0') {
+		if (port < 1 || port > 65535) {
+			printf("Metrics: bad port %s\n", address);
+			return -1;
+		}
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			goto fail;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		// Loopback only, the counters are nobody else's business
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			goto fail;
+		printf("Metrics on http://127.0.0.1:%ld/metrics\n", port);
+	}
+	else {
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			printf("Metrics: socket path too long\n");
+			return -1;
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			goto fail;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, address);
+		// A socket left over by an earlier run; any other file is not ours
+		// to remove, bind() then fails on it
+		if (lstat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(address);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			goto fail;
+		printf("Metrics on Unix socket %s\n", address);
+	}
+	if (listen(fd, 4) < 0)
+		goto fail;
+	return fd;
+fail:
+	printf("Metrics: %s: %s\n", address, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+int metrics_start(const char *address)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int err;
+
+	metrics_fd = metrics_listen(address);
+	if (metrics_fd < 0)
+		return -1;
+	// Signals stay with the demo loop, its waits are what they must interrupt
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&thread, NULL, metrics_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		printf("Metrics: cannot start thread: %s\n", strerror(err));
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
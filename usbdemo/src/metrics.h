@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+/**
+* Metrics exporter
+*
+* The demo loop counts what it does in the struct below and a thread of
+* its own serves it in the Prometheus text format, to a scraper connecting
+* over a Unix domain socket or to 127.0.0.1. The loop is the only writer,
+* so a count is a relaxed load and store, not a locked read-modify-write,
+* and nothing the loop waits on is shared with the exporter: a scrape reads
+* the counters while transfers go on, and may see the last one half counted.
+*
+* Round trips go into power of two buckets from 16 us to 1.07 s, coarser
+* than the demo histogram but few enough lines to scrape.
+*/
+//@{
+
+enum { METRIC_TIMEOUT, METRIC_STALL, METRIC_NO_DEVICE, METRIC_SHORT, METRIC_OTHER, METRIC_ERRORS };
+enum { DEVICE_CLOSED, DEVICE_OPEN, DEVICE_RECOVERING, DEVICE_STATES };
+
+#define METRICS_BUCKET_MIN_BITS 14      // first bucket up to 2^14 ns
+#define METRICS_BUCKETS         17      // up to 2^30 ns, then +Inf
+
+struct metrics {
+	_Alignas(RING_CACHE_LINE) atomic_ullong transfers;
+	atomic_ullong bytes_out;
+	atomic_ullong bytes_in;
+	atomic_ullong errors[METRIC_ERRORS];
+	atomic_ullong reconnects;
+	atomic_ullong rtt_sum_ns;
+	atomic_ullong rtt_buckets[METRICS_BUCKETS + 1];
+	atomic_int state;       // DEVICE_*
+};
+
+extern struct metrics metrics;
+
+//@}
+
+// Serve the metrics from a thread: a path is a Unix domain socket, a number
+// a TCP port on 127.0.0.1. 0 when listening, -1 with the reason printed.
+int metrics_start(const char *address);
+
+// Only the writing thread may count, others only read
+static inline void metrics_add(atomic_ullong *counter, uint64_t n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static inline void metrics_transfer(int bytes, uint64_t ns)
+{
+	unsigned bucket = 0;
+
+	if (ns > 1ull << METRICS_BUCKET_MIN_BITS) {
+		// ceil(log2(ns)), so the bucket's upper bound includes ns
+		bucket = 64 - __builtin_clzll(ns - 1) - METRICS_BUCKET_MIN_BITS;
+		if (bucket > METRICS_BUCKETS)
+			bucket = METRICS_BUCKETS;
+	}
+	metrics_add(&metrics.transfers, 1);
+	metrics_add(&metrics.bytes_out, bytes);
+	metrics_add(&metrics.bytes_in, bytes);
+	metrics_add(&metrics.rtt_sum_ns, ns);
+	metrics_add(&metrics.rtt_buckets[bucket], 1);
+}
+
+static inline void metrics_error(int error)
+{
+	int type = error == -ETIMEDOUT ? METRIC_TIMEOUT
+		: error == -EPIPE ? METRIC_STALL
+		: error == -ENODEV ? METRIC_NO_DEVICE
+		: error == -EREMOTEIO ? METRIC_SHORT
+		: METRIC_OTHER;
+
+	metrics_add(&metrics.errors[type], 1);
+}
+
+static inline void metrics_state(int state)
+{
+	atomic_store_explicit(&metrics.state, state, memory_order_relaxed);
+}
+
+#endif
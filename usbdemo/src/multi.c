@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "usbdemo.h"
+#include "ring.h"
+#include "stats.h"
+#include "verify.h"
+#include "frame.h"
+
+/**
+* Multi-device driver
+*
+* Every attached vendor device is opened with a context of its own: handle,
+* endpoints, buffers and counters, none of the single-device globals. One
+* worker thread per core runs interrupt loop backs; the unit of work is a
+* device, which a worker takes, runs for a batch of round trips and hands
+* back to the tail of its own deque. Before taking its next device a worker
+* looks at the other deques: when one holds at least as many waiting devices
+* as its own, it steals from the head of the fullest. A worker with nothing
+* to do steals for that reason, and so does a worker that serves fewer
+* devices than its share, blocking I/O never leaves it idle otherwise. A
+* device is never driven by two threads at once.
+*
+* The deques are Chase-Lev style: only the owner pushes, anyone takes from
+* the head with a compare-and-swap. The owner also takes from the head,
+* which rotates its devices round robin instead of running the last one
+* pushed over and over.
+*/
+//@{
+
+#define MULTI_DEVICES_MAX       64      // also the deque size, a power of two
+#define MULTI_WORKERS_MAX       64
+#define MULTI_BATCH             16      // round trips per device before requeueing
+#define MULTI_ERRORS_MAX        8       // consecutive errors before a device is dropped
+#define MULTI_IDLE_NS           1000000 // nap of a worker that found nothing to take
+
+struct multi_device {
+	usb_dev_handle *handle;
+	char path[32];
+	char serial[64];
+	unsigned char ep_in;
+	unsigned char ep_out;
+	int size;
+	uint8_t *buf_out;
+	uint8_t *buf_in;
+	// Written only by the worker holding the device, the deque orders the handover
+	struct lat_stats lat;
+	struct rto rto;           // each device its own, they need not answer alike
+	uint64_t verify_state;
+	struct frame_track frames;
+	uint64_t transfers;
+	unsigned long errors;
+	unsigned long mismatches;
+	unsigned long migrations; // taken by another worker than the previous batch
+	int last_worker;
+	int failed;               // consecutive errors
+	int dropped;
+};
+
+struct multi_deque {
+	_Alignas(RING_CACHE_LINE) atomic_ulong head;   // next device to take, any thread
+	_Alignas(RING_CACHE_LINE) atomic_ulong tail;   // next free slot, owner only
+	_Atomic(struct multi_device *) slots[MULTI_DEVICES_MAX];
+};
+
+struct multi_worker {
+	pthread_t thread;
+	int id;
+	struct multi_deque deque;
+	uint64_t batches;
+	uint64_t steals;
+	uint64_t idle;
+};
+
+static struct multi_device multi_devices[MULTI_DEVICES_MAX];
+static int multi_count;
+static struct multi_worker *multi_workers;
+static int multi_nworkers;
+static _Atomic uint64_t multi_end_ns;
+static atomic_int multi_active;   // devices not dropped yet
+
+//@}
+
+// Owner only; never overflows, there are no more devices than slots
+static void deque_push(struct multi_deque *q, struct multi_device *dev)
+{
+	unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&q->slots[tail % MULTI_DEVICES_MAX], dev, memory_order_relaxed);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+// Any thread, NULL when empty or another thread took the device first
+static struct multi_device *deque_take(struct multi_deque *q)
+{
+	unsigned long head = atomic_load_explicit(&q->head, memory_order_acquire);
+	unsigned long tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	struct multi_device *dev;
+
+	if (head >= tail)
+		return NULL;
+	dev = atomic_load_explicit(&q->slots[head % MULTI_DEVICES_MAX], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&q->head, &head, head + 1,
+		memory_order_acq_rel, memory_order_relaxed))
+		return NULL;
+	return dev;
+}
+
+// Standard GET_CONFIGURATION/GET_INTERFACE, -1 when the device does not answer
+static int multi_get_state(usb_dev_handle *handle, int recipient, int request)
+{
+	char value;
+
+	if (usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_STANDARD | recipient,
+		request, 0, 0, &value, 1, 1000) != 1)
+		return -1;
+	return (unsigned char)value;
+}
+
+// Configure one device and find its interrupt endpoints, same path as openinterface()
+static int multi_open(struct multi_device *dev, struct usb_bus *bus, struct usb_device *udev, int size)
+{
+	struct usb_interface *intf = udev->config->interface;
+	struct usb_interface_descriptor *alt = &intf->altsetting[intf->num_altsetting > 1 ? 1 : 0];
+	unsigned short ep_size = 0;
+	int i;
+
+	memset(dev, 0, sizeof(*dev));
+	rto_init(&dev->rto, loop_rto.floor_ms, loop_rto.ceiling_ms);
+	snprintf(dev->path, sizeof(dev->path), "%.15s/%.15s", bus->dirname, udev->filename);
+	dev->handle = usb_open(udev);
+	if (dev->handle == NULL) {
+		printf("%s: error: open failed\n", dev->path);
+		return -1;
+	}
+	if (multi_get_state(dev->handle, USB_RECIP_DEVICE, USB_REQ_GET_CONFIGURATION) != 1
+		&& usb_set_configuration(dev->handle, 1) < 0) {
+		printf("%s: error: setting config 1 failed\n", dev->path);
+		goto fail;
+	}
+	if (usb_claim_interface(dev->handle, 0) < 0) {
+		printf("%s: error: claiming interface 0 failed\n", dev->path);
+		goto fail;
+	}
+	if (intf->num_altsetting > 1
+		&& multi_get_state(dev->handle, USB_RECIP_INTERFACE, USB_REQ_GET_INTERFACE) != 1
+		&& usb_set_altinterface(dev->handle, 1) < 0) {
+		printf("%s: error: set alternate 1 interface 0 failed\n", dev->path);
+		goto fail;
+	}
+	for (i = 0; i < alt->bNumEndpoints; i++) {
+		struct usb_endpoint_descriptor *ep = &alt->endpoint[i];
+
+		if ((ep->bmAttributes & USB_ENDPOINT_TYPE_MASK) != USB_ENDPOINT_TYPE_INTERRUPT)
+			continue;
+		if ((ep->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN)
+			dev->ep_in = ep->bEndpointAddress;
+		else
+			dev->ep_out = ep->bEndpointAddress;
+		ep_size = ep_packet_size(ep->wMaxPacketSize);
+	}
+	if (!dev->ep_in || !dev->ep_out) {
+		printf("%s: error: no interrupt endpoints\n", dev->path);
+		goto fail;
+	}
+	if (udev->descriptor.iSerialNumber == 0
+		|| usb_get_string_simple(dev->handle, udev->descriptor.iSerialNumber, dev->serial, sizeof(dev->serial)) < 0)
+		strcpy(dev->serial, "-");
+	dev->size = size ? size : ep_size ? ep_size : UDI_VENDOR_LOOPBACK_SIZE;
+	dev->buf_out = malloc(dev->size);
+	dev->buf_in = malloc(dev->size);
+	dev->verify_state = multi_count + 1;
+	frame_reset(&dev->frames);
+	if (dev->buf_out == NULL || dev->buf_in == NULL) {
+		printf("%s: error: cannot allocate %d byte buffers\n", dev->path, dev->size);
+		goto fail;
+	}
+	for (i = 0; i < dev->size; i++)
+		dev->buf_out[i] = (uint8_t)(i + multi_count);
+	lat_reset(&dev->lat);
+	dev->last_worker = -1;
+	return 0;
+
+fail:
+	free(dev->buf_out);
+	free(dev->buf_in);
+	usb_close(dev->handle);
+	dev->handle = NULL;
+	return -1;
+}
+
+static void multi_close(struct multi_device *dev)
+{
+	usb_release_interface(dev->handle, 0);
+	usb_close(dev->handle);
+	free(dev->buf_out);
+	free(dev->buf_in);
+	dev->handle = NULL;
+}
+
+// One batch of round trips on a device, -1 once it is dropped
+static int multi_batch(struct multi_device *dev)
+{
+	uint64_t start, spent;
+	unsigned timeout;
+	int n, ret;
+
+	for (n = 0; n < MULTI_BATCH; n++) {
+		if (verify_pattern)
+			verify_fill(dev->buf_out, dev->size, &dev->verify_state);
+		if (frame_stamps)
+			frame_stamp(&dev->frames, dev->buf_out, dev->size);
+		timeout = rto_ms(&dev->rto);
+		start = now_ns();
+		ret = usb_interrupt_write(dev->handle, dev->ep_out, (char *)dev->buf_out, dev->size, timeout);
+		if (ret >= 0) {
+			spent = (now_ns() - start) / 1000000;
+			ret = usb_interrupt_read(dev->handle, dev->ep_in, (char *)dev->buf_in, dev->size,
+				spent < timeout ? timeout - spent : 1);
+		}
+		rto_update(&dev->rto, now_ns() - start, ret < 0 ? ret : 0);
+		if (ret < 0) {
+			dev->errors++;
+			if (++dev->failed >= MULTI_ERRORS_MAX) {
+				printf("%s: dropped after %d errors, last: %s\n", dev->path, dev->failed, strerror(-ret));
+				dev->dropped = 1;
+				return -1;
+			}
+			// A halt that is not set clears harmlessly
+			if (ret == -EPIPE) {
+				usb_clear_halt(dev->handle, dev->ep_out);
+				usb_clear_halt(dev->handle, dev->ep_in);
+			}
+			continue;
+		}
+		lat_add(&dev->lat, now_ns() - start);
+		if (frame_stamps)
+			frame_check(&dev->frames, dev->buf_in, ret, raw_ns());
+		dev->transfers++;
+		dev->failed = 0;
+		if (ret != dev->size || verify_mismatch(dev->buf_in, dev->buf_out, dev->size) != (size_t)dev->size)
+			dev->mismatches++;
+	}
+	return 0;
+}
+
+static unsigned long deque_waiting(struct multi_deque *q)
+{
+	unsigned long head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	return tail > head ? tail - head : 0;
+}
+
+// Own device, or one stolen from the fullest deque when that is no shorter
+static struct multi_device *multi_next(struct multi_worker *self)
+{
+	unsigned long own = deque_waiting(&self->deque), most = 0, n;
+	struct multi_worker *victim = NULL;
+	struct multi_device *dev;
+	int i;
+
+	for (i = 1; i < multi_nworkers; i++) {
+		struct multi_worker *w = &multi_workers[(self->id + i) % multi_nworkers];
+
+		if ((n = deque_waiting(&w->deque)) > most) {
+			most = n;
+			victim = w;
+		}
+	}
+	if (victim != NULL && most >= own) {
+		dev = deque_take(&victim->deque);
+		if (dev != NULL) {
+			self->steals++;
+			return dev;
+		}
+	}
+	return deque_take(&self->deque);
+}
+
+static void *multi_worker_main(void *arg)
+{
+	struct multi_worker *self = arg;
+	const struct timespec nap = { 0, MULTI_IDLE_NS };
+	struct multi_device *dev;
+
+	while (now_ns() < atomic_load_explicit(&multi_end_ns, memory_order_relaxed)
+		&& atomic_load_explicit(&multi_active, memory_order_relaxed) > 0) {
+		dev = multi_next(self);
+		if (dev == NULL) {
+			self->idle++;
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		if (dev->last_worker >= 0 && dev->last_worker != self->id)
+			dev->migrations++;
+		dev->last_worker = self->id;
+		self->batches++;
+		if (multi_batch(dev) < 0) {
+			atomic_fetch_sub_explicit(&multi_active, 1, memory_order_relaxed);
+			continue;
+		}
+		deque_push(&self->deque, dev);
+	}
+	return NULL;
+}
+
+static int multi_find(int size)
+{
+	struct usb_bus *bus;
+	struct usb_device *udev;
+
+	usb_find_devices();
+	for (bus = usb_get_busses(); bus; bus = bus->next) {
+		for (udev = bus->devices; udev; udev = udev->next) {
+			if (udev->descriptor.idVendor != DEVICE_VENDOR_VID || udev->descriptor.idProduct != DEVICE_VENDOR_PID)
+				continue;
+			if (multi_count == MULTI_DEVICES_MAX) {
+				printf("More than %d devices, the others are left alone\n", MULTI_DEVICES_MAX);
+				return multi_count;
+			}
+			if (multi_open(&multi_devices[multi_count], bus, udev, size) == 0) {
+				printf("Device %d: %s, serial %s, endpoints %02X/%02X, %d bytes\n", multi_count,
+					multi_devices[multi_count].path, multi_devices[multi_count].serial,
+					multi_devices[multi_count].ep_in, multi_devices[multi_count].ep_out,
+					multi_devices[multi_count].size);
+				multi_count++;
+			}
+		}
+	}
+	return multi_count;
+}
+
+static void multi_report(uint64_t elapsed, uint64_t cpu)
+{
+	static struct frame_track frames;
+	struct lat_stats all;
+	uint64_t transfers = 0, bytes = 0, steals = 0, batches = 0;
+	double seconds = elapsed / 1e9;
+	char label[48];
+	int i;
+
+	lat_reset(&all);
+	frame_reset(&frames);
+	printf("Multi-device loop back, %d devices, %d workers, %.1f s\n", multi_count, multi_nworkers, seconds);
+	for (i = 0; i < multi_count; i++) {
+		struct multi_device *dev = &multi_devices[i];
+
+		printf("- %s (%s): %.0f transfers/s, %.3f MB/s, %lu errors, %lu mismatches, %lu migrations%s\n",
+			dev->path, dev->serial, dev->transfers / seconds,
+			2.0 * dev->transfers * dev->size / seconds / 1e6,
+			dev->errors, dev->mismatches, dev->migrations, dev->dropped ? ", dropped" : "");
+		snprintf(label, sizeof(label), "%s round trip", dev->path);
+		lat_print(label, &dev->lat);
+		rto_print(&dev->rto);
+		if (frame_stamps) {
+			snprintf(label, sizeof(label), "%s frames", dev->path);
+			frame_print(label, &dev->frames);
+			frame_merge(&frames, &dev->frames);
+		}
+		lat_merge(&all, &dev->lat);
+		transfers += dev->transfers;
+		bytes += 2 * dev->transfers * dev->size;
+	}
+	for (i = 0; i < multi_nworkers; i++) {
+		struct multi_worker *w = &multi_workers[i];
+
+		printf("- Worker %d: %llu batches, %llu stolen, %llu idle naps\n", i,
+			(unsigned long long)w->batches, (unsigned long long)w->steals, (unsigned long long)w->idle);
+		steals += w->steals;
+		batches += w->batches;
+	}
+	printf("- Aggregate: %.0f transfers/s, %.3f MB/s, %llu of %llu batches stolen\n",
+		transfers / seconds, bytes / seconds / 1e6,
+		(unsigned long long)steals, (unsigned long long)batches);
+	lat_print("Aggregate round trip", &all);
+	if (frame_stamps)
+		frame_print("Aggregate frames", &frames);
+	cpu_print(cpu, elapsed, transfers);
+}
+
+int multi_run(int size, int workers, int seconds)
+{
+	uint64_t start, cpu;
+	int i, ret = 0;
+
+	if (multi_find(size) == 0) {
+		printf("Device not found\n");
+		return -1;
+	}
+	if (workers <= 0) {
+		// One per core, but a worker without a device would only nap
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers > multi_count)
+			workers = multi_count;
+	}
+	if (workers > MULTI_WORKERS_MAX)
+		workers = MULTI_WORKERS_MAX;
+	if (workers < 1)
+		workers = 1;
+	multi_workers = calloc(workers, sizeof(*multi_workers));
+	if (multi_workers == NULL) {
+		ret = -1;
+		goto out;
+	}
+	multi_nworkers = workers;
+	// Round robin to start with, stealing evens out the rest
+	for (i = 0; i < multi_nworkers; i++)
+		multi_workers[i].id = i;
+	for (i = 0; i < multi_count; i++)
+		deque_push(&multi_workers[i % multi_nworkers].deque, &multi_devices[i]);
+	atomic_store(&multi_active, multi_count);
+
+	cpu = cpu_ns();
+	start = now_ns();
+	atomic_store(&multi_end_ns, start + (uint64_t)seconds * 1000000000u);
+	for (i = 0; i < multi_nworkers; i++) {
+		if ((errno = pthread_create(&multi_workers[i].thread, NULL, multi_worker_main, &multi_workers[i])) != 0) {
+			printf("error: cannot start worker %d: %s\n", i, strerror(errno));
+			atomic_store(&multi_end_ns, 0);
+			multi_nworkers = i;
+			ret = -1;
+			break;
+		}
+	}
+	for (i = 0; i < multi_nworkers; i++)
+		pthread_join(multi_workers[i].thread, NULL);
+	if (ret == 0)
+		multi_report(now_ns() - start, cpu_ns() - cpu);
+	free(multi_workers);
+	multi_workers = NULL;
+
+out:
+	for (i = 0; i < multi_count; i++)
+		multi_close(&multi_devices[i]);
+	multi_count = 0;
+	return ret;
+}
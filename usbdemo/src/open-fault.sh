@@ -0,0 +1,8 @@
+#!/bin/sh
+# Every third interface claim fails: open mode has to retry those opens
+# and finish all of its rounds, none of them on a handle it already closed
+out=$(USBEMU_FAULTS=claim:3 ./usbdemo-emu -m open 2>&1)
+status=$?
+echo "$out"
+test $status -eq 0 || exit 1
+echo "$out" | grep -q "rounds each, [1-9][0-9]* failed opens retried" || exit 1
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "usbdemo.h"
+#include "stats.h"
+#include "verify.h"
+#include "frame.h"
+
+/**
+* Pipelined interrupt loopback
+*
+* libusb-0.1 only offers blocking transfers, so each slot of the pipeline is
+* a lane thread running its own write/read round trip. With depth lanes the
+* kernel holds up to depth OUT and depth IN URBs, and the host controller
+* can service both interrupt endpoints on every (micro)frame instead of
+* idling between two blocking calls.
+*/
+//@{
+
+struct lane {
+	pthread_t thread;
+	usb_dev_handle *handle;
+	uint8_t *buf_out;
+	uint8_t *buf_in;
+	int size;
+	struct lat_stats rtt;
+	unsigned long errors;
+	unsigned long mismatches;
+	uint64_t verify_state;
+};
+
+static atomic_int pipeline_stop;
+// One sequence for all lanes, so reordering between them shows
+static struct frame_track pipeline_frames;
+static pthread_mutex_t pipeline_frames_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//@}
+
+static void *lane_main(void *arg)
+{
+	struct lane *lane = arg;
+	// The frame header is not part of the sealed pattern, it is written last
+	int body = frame_stamps ? FRAME_SIZE : 0;
+	int verify = verify_pattern && lane->size - body > VERIFY_SEAL_SIZE;
+
+	while (!atomic_load_explicit(&pipeline_stop, memory_order_relaxed)) {
+		uint64_t start;
+
+		if (verify)
+			verify_seal(lane->buf_out + body, lane->size - body, &lane->verify_state);
+		if (frame_stamps)
+			frame_stamp(&pipeline_frames, lane->buf_out, lane->size);
+		start = now_ns();
+		if (0> usb_interrupt_write(lane->handle,
+			udi_vendor_ep_interrupt_out,
+			(char *)lane->buf_out,
+			lane->size,
+			1000)) {
+			lane->errors++;
+			break;
+		}
+		if (0> usb_interrupt_read(lane->handle,
+			udi_vendor_ep_interrupt_in,
+			(char *)lane->buf_in,
+			lane->size,
+			1000)) {
+			lane->errors++;
+			break;
+		}
+		lat_add(&lane->rtt, now_ns() - start);
+		if (frame_stamps) {
+			uint64_t now = raw_ns();
+
+			pthread_mutex_lock(&pipeline_frames_lock);
+			frame_check(&pipeline_frames, lane->buf_in, lane->size, now);
+			pthread_mutex_unlock(&pipeline_frames_lock);
+		}
+		// Lanes share the endpoints and an echo may be another lane's, so
+		// it is checked against its own trailer rather than buf_out
+		if (verify && verify_sealed(lane->buf_in + body, lane->size - body))
+			lane->mismatches++;
+	}
+	return NULL;
+}
+
+int pipeline_run(usb_dev_handle *handle, int depth, int seconds)
+{
+	struct lane *lanes;
+	struct lat_stats rtt;
+	unsigned long errors = 0, mismatches = 0;
+	uint64_t start, elapsed, cpu;
+	int started, i;
+
+	if (depth < 1 || seconds < 1) {
+		printf("error: depth and duration must be positive\n");
+		return -1;
+	}
+	lanes = calloc(depth, sizeof(*lanes));
+	if (lanes == NULL) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	printf("Pipelined interrupt loop back, %d bytes, depth %d, %d s\n", udi_vendor_buf_size, depth, seconds);
+	atomic_store(&pipeline_stop, 0);
+	frame_reset(&pipeline_frames);
+	start = now_ns();
+	cpu = cpu_ns();
+	for (started = 0; started < depth; started++) {
+		struct lane *lane = &lanes[started];
+
+		lane->handle = handle;
+		lane->size = udi_vendor_buf_size;
+		lane->verify_state = started + 1;
+		lane->buf_out = malloc(lane->size);
+		lane->buf_in = malloc(lane->size);
+		lat_reset(&lane->rtt);
+		if (lane->buf_out)
+			memcpy(lane->buf_out, udi_vendor_buf_out, lane->size);
+		if (lane->buf_out == NULL || lane->buf_in == NULL
+			|| pthread_create(&lane->thread, NULL, lane_main, lane)) {
+			printf("error: cannot start lane %d\n", started);
+			free(lane->buf_out);
+			free(lane->buf_in);
+			break;
+		}
+	}
+	sleep(seconds);
+	atomic_store(&pipeline_stop, 1);
+
+	lat_reset(&rtt);
+	for (i = 0; i < started; i++) {
+		pthread_join(lanes[i].thread, NULL);
+		free(lanes[i].buf_out);
+		free(lanes[i].buf_in);
+		lat_merge(&rtt, &lanes[i].rtt);
+		errors += lanes[i].errors;
+		mismatches += lanes[i].mismatches;
+	}
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+	free(lanes);
+
+	printf("- Transfers: %llu (%.1f/s), errors: %lu\n",
+		(unsigned long long)rtt.count, rtt.count * 1e9 / elapsed, errors);
+	if (verify_pattern)
+		printf("- Verified (%s): %lu mismatches\n", verify_name(), mismatches);
+	if (frame_stamps)
+		frame_print("Frames", &pipeline_frames);
+	lat_print("Round trip", &rtt);
+	cpu_print(cpu, elapsed, rtt.count);
+	return (errors || started < depth) ? -1 : 0;
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "usbdemo.h"
+#include "stats.h"
+#include "metrics.h"
+
+/**
+* Tiered error recovery
+*
+* A failed loop back escalates through cheaper fixes before giving up on
+* the handle: a timeout is retried, a stall clears the halt of the failed
+* endpoint, then the device is reset, and only then closed and reopened.
+* Each tier is checked with a new loop back, and the time from the error
+* to the first good transfer is counted per tier.
+*/
+//@{
+
+#define RECOVER_RETRIES 2
+#define RECOVER_POLL_MS 20      // rediscovery interval of the benchmark
+
+enum { RECOVER_RETRY, RECOVER_CLEAR_HALT, RECOVER_RESET, RECOVER_REOPEN, RECOVER_TIERS };
+
+static const char *recover_names[RECOVER_TIERS] = { "retry", "clear halt", "reset", "reopen" };
+
+static unsigned long recover_attempts[RECOVER_TIERS];
+static struct lat_stats recover_time[RECOVER_TIERS];
+static unsigned long recover_failed;
+static unsigned long recover_lost;  // failed loop backs of the recoveries themselves
+static int recover_initialized;
+int recover_quiet;
+
+//@}
+
+/**
+* Recovery benchmark
+*
+* Back-to-back loop backs against a device that fails, at best the emulated
+* one with a USBEMU_FAULTS profile. A failed loop back starts an outage
+* that recover() works on; when it gives up, the device is rediscovered
+* through backend->open() every RECOVER_POLL_MS. The outage ends with the
+* next good loop back, its time to recover is counted from the start of
+* the failed transfer, detection included, under the error that began it.
+* Every loop back that failed or came back wrong is a lost transfer.
+*/
+//@{
+
+struct recover_cause {
+	int error;
+	const char *name;
+	struct lat_hist ttr;
+};
+
+static struct recover_cause recover_causes[] = {
+	{ .error = -ETIMEDOUT, .name = "timeout" },
+	{ .error = -EPIPE, .name = "stall" },
+	{ .error = -EREMOTEIO, .name = "short read" },
+	{ .error = -ENODEV, .name = "disconnect" },
+	{ .error = 0, .name = "other error" },
+};
+
+#define RECOVER_CAUSES (sizeof(recover_causes) / sizeof(recover_causes[0]))
+
+//@}
+
+static int recover_loop_back(void)
+{
+	int ret = backend->loop_back();
+
+	if (ret)
+		recover_lost++;
+	return ret;
+}
+
+static int recover_tier(int tier)
+{
+	int tries;
+
+	switch (tier) {
+	case RECOVER_RETRY:
+		for (tries = 0; tries < RECOVER_RETRIES; tries++) {
+			if (recover_loop_back() == 0)
+				return 0;
+		}
+		return -1;
+	case RECOVER_CLEAR_HALT:
+		// Unknown endpoint: a halt that is not set clears harmlessly
+		if (udi_vendor_ep_failed) {
+			if (backend->clear_halt(udi_vendor_ep_failed) < 0)
+				return -1;
+		}
+		else if (backend->clear_halt(udi_vendor_ep_interrupt_out) < 0
+			|| backend->clear_halt(udi_vendor_ep_interrupt_in) < 0) {
+			return -1;
+		}
+		break;
+	case RECOVER_RESET:
+		if (backend->reset() < 0)
+			return -1;
+		break;
+	case RECOVER_REOPEN:
+		backend->close();
+		if (!backend->open())
+			return -1;
+		break;
+	}
+	return recover_loop_back();
+}
+
+static void recover_print(void)
+{
+	char name[32];
+	int tier;
+
+	for (tier = 0; tier < RECOVER_TIERS; tier++) {
+		if (recover_attempts[tier] == 0)
+			continue;
+		printf("- Recovery by %s: %lu attempts, %llu successful\n", recover_names[tier],
+			recover_attempts[tier], (unsigned long long)recover_time[tier].count);
+		snprintf(name, sizeof(name), "%s time", recover_names[tier]);
+		lat_print(name, &recover_time[tier]);
+	}
+	if (recover_failed)
+		printf("- Recovery failed: %lu\n", recover_failed);
+}
+
+int recover(int error)
+{
+	uint64_t start = now_ns();
+	int tier;
+
+	if (!recover_initialized) {
+		for (tier = 0; tier < RECOVER_TIERS; tier++)
+			lat_reset(&recover_time[tier]);
+		recover_initialized = 1;
+	}
+	if (error == -ETIMEDOUT)
+		tier = RECOVER_RETRY;
+	else if (error == -EPIPE)
+		tier = RECOVER_CLEAR_HALT;
+	else if (error == -ENODEV)
+		tier = RECOVER_REOPEN;
+	else
+		tier = RECOVER_RETRY;
+
+	for (; tier < RECOVER_TIERS; tier++) {
+		recover_attempts[tier]++;
+		if (!backend->is_open() && tier < RECOVER_REOPEN)
+			continue;
+		if (recover_tier(tier) == 0) {
+			uint64_t elapsed = now_ns() - start;
+
+			lat_add(&recover_time[tier], elapsed);
+			if (tier == RECOVER_REOPEN)
+				metrics_add(&metrics.reconnects, 1);
+			if (!recover_quiet) {
+				printf("Recovered by %s in %.2f ms\n", recover_names[tier], elapsed / 1e6);
+				recover_print();
+			}
+			return 0;
+		}
+	}
+	recover_failed++;
+	if (!recover_quiet) {
+		printf("Recovery failed\n");
+		recover_print();
+	}
+	if (backend->is_open())
+		backend->close();
+	return -1;
+}
+
+static struct recover_cause *recover_cause(int error)
+{
+	unsigned i;
+
+	for (i = 0; i < RECOVER_CAUSES - 1; i++)
+		if (recover_causes[i].error == error)
+			break;
+	return &recover_causes[i];
+}
+
+int recover_run(int seconds)
+{
+	struct recover_cause *cause = NULL;
+	unsigned long transfers = 0, lost = 0, corrupt = 0, reopens = 0, outages = 0;
+	unsigned long lost_before = recover_lost;
+	uint64_t end, start, outage = 0;
+	char label[48];
+	unsigned i;
+	int ret;
+
+	if (seconds < 1) {
+		printf("error: duration must be positive\n");
+		return -1;
+	}
+	for (i = 0; i < RECOVER_CAUSES; i++)
+		lat_hist_reset(&recover_causes[i].ttr);
+	recover_quiet = 1;
+
+	printf("Recovery benchmark, %d s\n", seconds);
+	end = now_ns() + (uint64_t)seconds * 1000000000u;
+	while ((start = now_ns()) < end) {
+		if (!backend->is_open()) {
+			if (!backend->open()) {
+				usleep(RECOVER_POLL_MS * 1000);
+				continue;
+			}
+			if (outage)
+				reopens++;
+		}
+		memset(udi_vendor_buf_in, 0, udi_vendor_buf_size);
+		ret = backend->loop_back();
+		if (ret == 0 && memcmp(udi_vendor_buf_in, udi_vendor_buf_out, udi_vendor_buf_size) != 0) {
+			corrupt++;
+			lost++;
+			continue;
+		}
+		if (ret == 0) {
+			transfers++;
+			if (outage) {
+				lat_hist_add(&cause->ttr, now_ns() - outage);
+				outage = 0;
+			}
+			continue;
+		}
+		lost++;
+		if (!outage) {
+			outage = start;
+			cause = recover_cause(ret);
+			outages++;
+		}
+		if (recover(ret) == 0) {
+			transfers++;
+			lat_hist_add(&cause->ttr, now_ns() - outage);
+			outage = 0;
+		}
+	}
+	recover_quiet = 0;
+	lost += recover_lost - lost_before;
+
+	printf("Recovery benchmark: %lu good transfers, %lu lost (%lu corrupt), %lu outages, %lu rediscoveries%s\n",
+		transfers, lost, corrupt, outages, reopens, outage ? ", the last one unrecovered" : "");
+	for (i = 0; i < RECOVER_CAUSES; i++) {
+		if (recover_causes[i].ttr.count == 0)
+			continue;
+		snprintf(label, sizeof(label), "Time to recover from %s", recover_causes[i].name);
+		lat_hist_print(label, &recover_causes[i].ttr);
+	}
+	recover_print();
+	return 0;
+}
@@ -0,0 +1,27 @@
+#include <stdlib.h>
+#include "ring.h"
+
+int ring_init(struct ring *ring, unsigned slots, size_t slot_size)
+{
+	unsigned size = 1;
+
+	// Round up to a power of two so indexes wrap with a mask
+	while (size < slots)
+		size <<= 1;
+	// Every slot starts as aligned as the first, whatever trails its header
+	slot_size = (slot_size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+	ring->slots = calloc(size, slot_size);
+	if (ring->slots == NULL)
+		return -1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->mask = size - 1;
+	ring->slot_size = slot_size;
+	return 0;
+}
+
+void ring_free(struct ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
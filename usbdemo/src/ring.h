@@ -0,0 +1,77 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+* Lock-free single-producer/single-consumer ring of fixed-size slots
+*
+* The producer fills the slot returned by ring_produce() and publishes it with
+* ring_produce_commit(); the consumer does the same with ring_consume() and
+* ring_consume_commit(). Head and tail live on separate cache lines so the
+* two sides never write the same line. Slot sizes are rounded up to the
+* largest fundamental alignment, so a struct ending in a flexible array
+* member is aligned in every slot, not just the first.
+*/
+//@{
+
+#define RING_CACHE_LINE 64
+
+struct ring {
+	_Alignas(RING_CACHE_LINE) atomic_uint head; // next slot to consume, written by consumer
+	_Alignas(RING_CACHE_LINE) atomic_uint tail; // next slot to produce, written by producer
+	_Alignas(RING_CACHE_LINE) unsigned mask;
+	size_t slot_size;
+	uint8_t *slots;
+};
+
+//@}
+
+int ring_init(struct ring *ring, unsigned slots, size_t slot_size);
+void ring_free(struct ring *ring);
+
+// Free slot for the producer, NULL when the ring is full
+static inline void *ring_produce(struct ring *ring)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head > ring->mask)
+		return NULL;
+	return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+static inline void ring_produce_commit(struct ring *ring)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Oldest filled slot for the consumer, NULL when the ring is empty
+static inline void *ring_consume(struct ring *ring)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+	return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+static inline void ring_consume_commit(struct ring *ring)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline unsigned ring_count(struct ring *ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire)
+		- atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+#endif
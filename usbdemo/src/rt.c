@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "usbdemo.h"
+#include "stats.h"
+
+/**
+* Real-time latency mode
+*
+* Measures the interrupt loop back twice, first as the demo runs it and then
+* with what closed-loop control needs: memory locked and pre-faulted so no
+* page fault lands in a round trip, the thread under SCHED_FIFO and pinned
+* to the CPU that services the host controller interrupt, where the
+* completion wakes it without a cross-CPU IPI. The priority stays below the
+* threaded interrupt handlers (50), which deliver the completions. A backend
+* that completes transfers on an event thread of its own (usb1) gets that
+* thread pinned and raised the same way, it is in every round trip too.
+*/
+//@{
+
+#define RT_PRIORITY         49
+#define RT_STACK_PREFAULT   (256 * 1024)
+
+struct rt_result {
+	struct lat_hist rtt;
+	unsigned long errors;
+};
+
+//@}
+
+// Interrupt of the controller behind a bus, from the PCI device of its root hub
+static int rt_bus_irq(int busnum)
+{
+	char path[96];
+	struct dirent *d;
+	DIR *dir;
+	FILE *f;
+	int irq = -1;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%d/../msi_irqs", busnum);
+	dir = opendir(path);
+	if (dir != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] != '.' && (irq < 0 || atoi(d->d_name) < irq))
+				irq = atoi(d->d_name);
+		}
+		closedir(dir);
+		if (irq >= 0)
+			return irq;
+	}
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%d/../irq", busnum);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &irq) != 1 || irq <= 0)
+		irq = -1;
+	fclose(f);
+	return irq;
+}
+
+// First xhci_hcd line of /proc/interrupts, when the bus is not known
+static int rt_xhci_irq(void)
+{
+	char line[512];
+	FILE *f = fopen("/proc/interrupts", "r");
+	int irq = -1;
+
+	if (f == NULL)
+		return -1;
+	while (irq < 0 && fgets(line, sizeof(line), f) != NULL) {
+		if (strstr(line, "xhci") != NULL && sscanf(line, " %d:", &irq) != 1)
+			irq = -1;
+	}
+	fclose(f);
+	return irq;
+}
+
+// First CPU the interrupt is delivered to, -1 when unknown
+static int rt_irq_cpu(int irq)
+{
+	static const char *files[] = { "effective_affinity_list", "smp_affinity_list" };
+	char path[64];
+	unsigned i;
+	int cpu;
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		FILE *f;
+
+		snprintf(path, sizeof(path), "/proc/irq/%d/%s", irq, files[i]);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fscanf(f, "%d", &cpu) != 1)
+			cpu = -1;
+		fclose(f);
+		if (cpu >= 0)
+			return cpu;
+	}
+	return -1;
+}
+
+static int rt_pick_cpu(void)
+{
+	struct usbindex_entry entry;
+	int irq = -1, cpu;
+
+	if (usbindex_lookup(DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, opt_serial, &entry) > 0)
+		irq = rt_bus_irq(entry.busnum);
+	if (irq < 0)
+		irq = rt_xhci_irq();
+	if (irq < 0) {
+		printf("- Host controller interrupt not found, CPU 0\n");
+		return 0;
+	}
+	cpu = rt_irq_cpu(irq);
+	printf("- Host controller interrupt %d on CPU %d\n", irq, cpu);
+	return cpu < 0 ? 0 : cpu;
+}
+
+static void rt_prefault_stack(void)
+{
+	volatile char stack[RT_STACK_PREFAULT];
+	unsigned i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static void rt_thread_enter(pthread_t thread, const char *who, int cpu)
+{
+	struct sched_param param = { .sched_priority = RT_PRIORITY };
+	cpu_set_t set;
+	int err;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((err = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0)
+		printf("- Pinning %s to CPU %d: %s\n", who, cpu, strerror(err));
+	else
+		printf("- %s pinned to CPU %d\n", who, cpu);
+	if ((err = pthread_setschedparam(thread, SCHED_FIFO, &param)) != 0)
+		printf("- %s SCHED_FIFO: %s\n", who, strerror(err));
+	else
+		printf("- %s SCHED_FIFO priority %d\n", who, RT_PRIORITY);
+}
+
+static void rt_thread_leave(pthread_t thread, const cpu_set_t *affinity)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	pthread_setschedparam(thread, SCHED_OTHER, &param);
+	pthread_setaffinity_np(thread, sizeof(*affinity), affinity);
+}
+
+// Best effort: what cannot be had is reported and the run goes on
+static void rt_enter(int cpu, const pthread_t *events)
+{
+#ifdef __GLIBC__
+	// Keep freed memory, a later malloc() must not fault pages in again
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		printf("- mlockall: %s\n", strerror(errno));
+	else
+		printf("- Memory locked\n");
+	// Locked pages are resident, writing also breaks copy-on-write sharing
+	memset(udi_vendor_buf_in, 0, udi_vendor_buf_size);
+	rt_prefault_stack();
+
+	if (cpu < 0)
+		cpu = rt_pick_cpu();
+	rt_thread_enter(pthread_self(), "Loop thread", cpu);
+	if (events != NULL)
+		rt_thread_enter(*events, "Event thread", cpu);
+}
+
+static int rt_measure(struct rt_result *r, int seconds)
+{
+	uint64_t end = raw_ns() + (uint64_t)seconds * 1000000000u, start;
+	int ret;
+
+	lat_hist_reset(&r->rtt);
+	r->errors = 0;
+	while ((start = raw_ns()) < end) {
+		ret = backend->loop_back();
+		if (ret) {
+			r->errors++;
+			if (recover(ret))
+				return -1;
+			continue;
+		}
+		lat_hist_add(&r->rtt, raw_ns() - start);
+	}
+	return 0;
+}
+
+static void rt_report(struct rt_result *normal, struct rt_result *rt)
+{
+	static const struct { const char *name; double p; } rows[] = {
+		{ "min", 0 }, { "p50", 50 }, { "p90", 90 }, { "p99", 99 }, { "p99.9", 99.9 }, { "max", 100 },
+	};
+	unsigned i;
+
+	printf("%-16s %15s %15s\n", "Round trip", "default", "real-time");
+	printf("- %-14s %15llu %15llu\n", "samples",
+		(unsigned long long)normal->rtt.count, (unsigned long long)rt->rtt.count);
+	printf("- %-14s %15lu %15lu\n", "errors", normal->errors, rt->errors);
+	for (i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+		printf("- %-14s %12.1f us %12.1f us\n", rows[i].name,
+			lat_hist_percentile(&normal->rtt, rows[i].p) / 1e3,
+			lat_hist_percentile(&rt->rtt, rows[i].p) / 1e3);
+}
+
+int rt_run(int cpu, int seconds)
+{
+	// Histograms in static storage, locked along with the rest
+	static struct rt_result normal, rt;
+	cpu_set_t affinity, events_affinity;
+	pthread_t events;
+	int has_events, ret;
+
+	pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+	has_events = backend->event_thread != NULL && backend->event_thread(&events);
+	if (has_events)
+		pthread_getaffinity_np(events, sizeof(events_affinity), &events_affinity);
+
+	printf("Default scheduling, %d s\n", seconds);
+	if (rt_measure(&normal, seconds))
+		return -1;
+	printf("Real-time scheduling, %d s\n", seconds);
+	rt_enter(cpu, has_events ? &events : NULL);
+	ret = rt_measure(&rt, seconds);
+	rt_thread_leave(pthread_self(), &affinity);
+	if (has_events)
+		rt_thread_leave(events, &events_affinity);
+	munlockall();
+	if (ret == 0)
+		rt_report(&normal, &rt);
+	return ret;
+}
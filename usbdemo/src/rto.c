@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <errno.h>
+#include "rto.h"
+
+// The timeout has ms granularity, a variation below it adds nothing
+#define RTO_GRANULARITY_NS 1000000u
+
+void rto_init(struct rto *r, unsigned floor_ms, unsigned ceiling_ms)
+{
+	r->srtt_ns = 0;
+	r->rttvar_ns = 0;
+	r->floor_ms = floor_ms ? floor_ms : 1;
+	r->ceiling_ms = ceiling_ms < r->floor_ms ? r->floor_ms : ceiling_ms;
+	r->backoff = 0;
+	r->samples = 0;
+	r->timeouts = 0;
+}
+
+unsigned rto_ms(const struct rto *r)
+{
+	uint64_t var, ms;
+
+	if (r->samples == 0)
+		return r->ceiling_ms;
+	var = 4 * r->rttvar_ns;
+	if (var < RTO_GRANULARITY_NS)
+		var = RTO_GRANULARITY_NS;
+	ms = (r->srtt_ns + var + 999999) / 1000000;
+	if (r->backoff)
+		ms <<= r->backoff < 16 ? r->backoff : 16;
+	if (ms < r->floor_ms)
+		return r->floor_ms;
+	return ms > r->ceiling_ms ? r->ceiling_ms : ms;
+}
+
+void rto_update(struct rto *r, uint64_t rtt_ns, int status)
+{
+	uint64_t err;
+
+	if (status == -ETIMEDOUT) {
+		r->timeouts++;
+		r->backoff++;
+		return;
+	}
+	if (status != 0)
+		return;
+	r->backoff = 0;
+	if (r->samples++ == 0) {
+		r->srtt_ns = rtt_ns;
+		r->rttvar_ns = rtt_ns / 2;
+		return;
+	}
+	// RTTVAR first, from the SRTT before this sample; beta 1/4, alpha 1/8
+	err = rtt_ns > r->srtt_ns ? rtt_ns - r->srtt_ns : r->srtt_ns - rtt_ns;
+	r->rttvar_ns = r->rttvar_ns - r->rttvar_ns / 4 + err / 4;
+	r->srtt_ns = r->srtt_ns - r->srtt_ns / 8 + rtt_ns / 8;
+}
+
+void rto_print(const struct rto *r)
+{
+	if (r->samples == 0)
+		return;
+	printf("- Timeout: %u ms (srtt %.1f us, rttvar %.1f us, floor %u ms, ceiling %u ms), %llu timeouts\n",
+		rto_ms(r), r->srtt_ns / 1e3, r->rttvar_ns / 1e3, r->floor_ms, r->ceiling_ms,
+		(unsigned long long)r->timeouts);
+}
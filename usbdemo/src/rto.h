@@ -0,0 +1,38 @@
+#ifndef RTO_H
+#define RTO_H
+
+#include <stdint.h>
+
+/**
+* Adaptive transfer timeout
+*
+* Running estimate of the round trip time and its variation as TCP keeps
+* it (RFC 6298): the timeout is SRTT + 4 * RTTVAR, clamped to a floor and a
+* ceiling. Until the first sample it is the ceiling, and each timeout in a
+* row doubles it so a slow device is not given up on at once.
+*/
+//@{
+
+struct rto {
+	uint64_t srtt_ns;
+	uint64_t rttvar_ns;
+	unsigned floor_ms;
+	unsigned ceiling_ms;
+	unsigned backoff;       // timeouts in a row
+	uint64_t samples;
+	uint64_t timeouts;
+};
+
+//@}
+
+void rto_init(struct rto *r, unsigned floor_ms, unsigned ceiling_ms);
+
+// Timeout for the next transfer in ms, libusb's unit
+unsigned rto_ms(const struct rto *r);
+
+// Result of a transfer that started rtt_ns ago: 0 or -errno
+void rto_update(struct rto *r, uint64_t rtt_ns, int status);
+
+void rto_print(const struct rto *r);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+void lat_reset(struct lat_stats *s)
+{
+	s->count = 0;
+	s->sum_ns = 0;
+	s->min_ns = UINT64_MAX;
+	s->max_ns = 0;
+}
+
+void lat_merge(struct lat_stats *dst, const struct lat_stats *src)
+{
+	dst->count += src->count;
+	dst->sum_ns += src->sum_ns;
+	if (src->min_ns < dst->min_ns)
+		dst->min_ns = src->min_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+}
+
+void lat_print(const char *label, const struct lat_stats *s)
+{
+	if (s->count == 0) {
+		printf("- %s: no samples\n", label);
+		return;
+	}
+	printf("- %s: min %.1f us, avg %.1f us, max %.1f us\n", label,
+		s->min_ns / 1e3, (double)s->sum_ns / s->count / 1e3, s->max_ns / 1e3);
+}
+
+void lat_hist_reset(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	unsigned i;
+
+	dst->count += src->count;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+// Highest value that lands in bucket i
+static uint64_t lat_hist_upper(unsigned i)
+{
+	unsigned shift;
+
+	if (i < 2 * LAT_HIST_HALF)
+		return i;
+	shift = i / LAT_HIST_HALF - 1;
+	return ((uint64_t)(i % LAT_HIST_HALF + LAT_HIST_HALF + 1) << shift) - 1;
+}
+
+uint64_t lat_hist_percentile(const struct lat_hist *h, double p)
+{
+	uint64_t rank, seen = 0, upper;
+	unsigned i;
+
+	if (h->count == 0)
+		return 0;
+	// Nearest rank, the first sample for p = 0
+	rank = (uint64_t)(p / 100 * h->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	upper = lat_hist_upper(i);
+	return upper < h->max_ns ? upper : h->max_ns;
+}
+
+void lat_hist_print(const char *label, const struct lat_hist *h)
+{
+	if (h->count == 0) {
+		printf("- %s: no samples\n", label);
+		return;
+	}
+	printf("- %s: %llu samples, mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		label, (unsigned long long)h->count, (double)h->sum_ns / h->count / 1e3,
+		lat_hist_percentile(h, 50) / 1e3, lat_hist_percentile(h, 90) / 1e3,
+		lat_hist_percentile(h, 99) / 1e3, lat_hist_percentile(h, 99.9) / 1e3, h->max_ns / 1e3);
+}
+
+uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000u
+		+ (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000u;
+}
+
+void cpu_print(uint64_t cpu, uint64_t elapsed, uint64_t transfers)
+{
+	if (transfers == 0 || elapsed == 0)
+		return;
+	printf("- CPU: %.2f us per transfer, %.1f%% of one core\n",
+		cpu / 1e3 / transfers, cpu * 100.0 / elapsed);
+}
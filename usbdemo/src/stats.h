@@ -0,0 +1,109 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+* Latency accumulator, one per thread so the hot path takes no lock
+*/
+struct lat_stats {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Clock for measuring round trips: not slewed by NTP, only differences mean anything
+static inline uint64_t raw_ns(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline void lat_add(struct lat_stats *s, uint64_t ns)
+{
+	s->count++;
+	s->sum_ns += ns;
+	if (ns < s->min_ns)
+		s->min_ns = ns;
+	if (ns > s->max_ns)
+		s->max_ns = ns;
+}
+
+void lat_reset(struct lat_stats *s);
+void lat_merge(struct lat_stats *dst, const struct lat_stats *src);
+void lat_print(const char *label, const struct lat_stats *s);
+
+/**
+* Latency histogram, HDR style
+*
+* Each power of two is split into 32 linear buckets, so a sample is kept to
+* within 1/32 of its value anywhere from 1 ns to 68 s, in a fixed 8 KiB.
+* Adding a sample touches one counter and never allocates; larger samples
+* count in the last bucket, max_ns stays exact.
+*/
+//@{
+
+#define LAT_HIST_SUB_BITS   6       // values below 2^6 ns get a bucket each
+#define LAT_HIST_MAX_BITS   36      // 2^36 ns, 68.7 s
+#define LAT_HIST_HALF       (1u << (LAT_HIST_SUB_BITS - 1))
+#define LAT_HIST_BUCKETS    ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 2) * LAT_HIST_HALF)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+static inline unsigned lat_hist_index(uint64_t ns)
+{
+	unsigned shift;
+
+	if (ns >> LAT_HIST_MAX_BITS)
+		ns = (1ull << LAT_HIST_MAX_BITS) - 1;
+	if (ns < 2 * LAT_HIST_HALF)
+		return (unsigned)ns;
+	// Top LAT_HIST_SUB_BITS bits of the value, the leading one included
+	shift = 63 - __builtin_clzll(ns) - LAT_HIST_SUB_BITS + 1;
+	return shift * LAT_HIST_HALF + (unsigned)(ns >> shift);
+}
+
+static inline void lat_hist_add(struct lat_hist *h, uint64_t ns)
+{
+	h->count++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[lat_hist_index(ns)]++;
+}
+
+//@}
+
+void lat_hist_reset(struct lat_hist *h);
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+// Smallest value at least p percent of the samples do not exceed, 0 without samples
+uint64_t lat_hist_percentile(const struct lat_hist *h, double p);
+// One line: samples, mean, p50, p90, p99, p99.9 and max
+void lat_hist_print(const char *label, const struct lat_hist *h);
+
+// User plus system CPU time of the whole process
+uint64_t cpu_ns(void);
+void cpu_print(uint64_t cpu, uint64_t elapsed, uint64_t transfers);
+
+#endif
@@ -0,0 +1,243 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "usbdemo.h"
+
+#if defined(__linux__) && !defined(USBEMU)
+
+/**
+* sysfs device index
+*
+* Keeps the VID/PID/serial of every device under /sys/bus/usb/devices so
+* the usb1 and usbfs backends can open the matching device node directly
+* instead of enumerating every bus. libusb-0.1 cannot open a device it has
+* not enumerated itself, so usb0 still calls usb_find_devices() and only
+* uses the index to skip that when nothing matches and to pick the device.
+* The index is built once; while hotplug events are followed it is updated
+* one device at a time, otherwise each lookup rescans. The bus path of the
+* last device found is kept in a small file under $XDG_RUNTIME_DIR, private
+* to the user, and the next run checks that one device before scanning
+* anything; without that directory nothing is kept.
+*/
+//@{
+
+#ifndef USBINDEX_ROOT
+#define USBINDEX_ROOT   "/sys/bus/usb/devices"
+#endif
+#define USBINDEX_MAX    256
+
+static struct usbindex_entry usbindex[USBINDEX_MAX];
+static int usbindex_count;
+static int usbindex_valid;  // index kept current by usbindex_uevent()
+static int usbindex_follow; // hotplug events are being fed
+
+//@}
+
+static int sysfs_read(const char *name, const char *attr, char *buf, int size)
+{
+	char path[sizeof(USBINDEX_ROOT) + 300];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", USBINDEX_ROOT, name, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	buf[len] = 0;
+	return len;
+}
+
+// Fill an entry from the attributes of one device, -1 when it is not a device
+static int usbindex_read(const char *name, struct usbindex_entry *e)
+{
+	char buf[64];
+
+	// Interfaces ("1-1:1.0") have no device attributes
+	if (name[0] == '.' || strchr(name, ':') || strlen(name) >= sizeof(e->path))
+		return -1;
+	memset(e, 0, sizeof(*e));
+	strcpy(e->path, name);
+	if (sysfs_read(name, "idVendor", buf, sizeof(buf)) < 0)
+		return -1;
+	e->vid = strtoul(buf, NULL, 16);
+	if (sysfs_read(name, "idProduct", buf, sizeof(buf)) < 0)
+		return -1;
+	e->pid = strtoul(buf, NULL, 16);
+	if (sysfs_read(name, "bcdDevice", buf, sizeof(buf)) >= 0)
+		e->bcd = strtoul(buf, NULL, 16);
+	if (sysfs_read(name, "busnum", buf, sizeof(buf)) < 0)
+		return -1;
+	e->busnum = atoi(buf);
+	if (sysfs_read(name, "devnum", buf, sizeof(buf)) < 0)
+		return -1;
+	e->devnum = atoi(buf);
+	if (sysfs_read(name, "speed", buf, sizeof(buf)) >= 0)
+		e->speed = atoi(buf);
+	sysfs_read(name, "serial", e->serial, sizeof(e->serial));
+	return 0;
+}
+
+static int usbindex_scan(void)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(USBINDEX_ROOT);
+	if (dir == NULL)
+		return -1;
+	usbindex_count = 0;
+	while ((d = readdir(dir)) != NULL && usbindex_count < USBINDEX_MAX) {
+		if (usbindex_read(d->d_name, &usbindex[usbindex_count]) == 0)
+			usbindex_count++;
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int usbindex_match(const struct usbindex_entry *e, uint16_t vid, uint16_t pid, const char *serial)
+{
+	return e->vid == vid && e->pid == pid && (serial == NULL || strcmp(e->serial, serial) == 0);
+}
+
+// Only in the user's own runtime directory, a shared one such as /tmp
+// would let anybody plant the file or a link in its place
+static int usbindex_last_file(char *path, int size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if (dir == NULL || *dir != '/')
+		return -1;
+	n = snprintf(path, size, "%s/usbdemo-%04x-%04x.last", dir, DEVICE_VENDOR_VID, DEVICE_VENDOR_PID);
+	return n < size ? 0 : -1;
+}
+
+static int usbindex_last_load(struct usbindex_entry *e)
+{
+	char path[300], name[sizeof(e->path)];
+	ssize_t n;
+	int fd;
+
+	if (usbindex_last_file(path, sizeof(path)) < 0)
+		return -1;
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, name, sizeof(name) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	name[n] = '\0';
+	name[strcspn(name, "\n")] = '\0';
+	// A bus path is one sysfs name, nothing to climb out of the tree with
+	if (strchr(name, '/') != NULL || strcmp(name, "..") == 0)
+		return -1;
+	return usbindex_read(name, e);
+}
+
+static void usbindex_last_save(const struct usbindex_entry *e)
+{
+	static char saved[sizeof(e->path)];
+	char path[300], line[sizeof(e->path) + 1];
+	int fd, len;
+
+	if (strcmp(saved, e->path) == 0)
+		return;
+	if (usbindex_last_file(path, sizeof(path)) < 0)
+		return;
+	// Never through a symbolic link, and readable by the user only
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	len = snprintf(line, sizeof(line), "%s\n", e->path);
+	if (write(fd, line, len) == len)
+		strcpy(saved, e->path);
+	close(fd);
+}
+
+int usbindex_lookup(uint16_t vid, uint16_t pid, const char *serial, struct usbindex_entry *found)
+{
+	int i;
+
+	if (!usbindex_valid) {
+		// Last known bus path first, a restart then reads one device only
+		if (usbindex_last_load(found) == 0 && usbindex_match(found, vid, pid, serial))
+			return 1;
+		if (usbindex_scan() < 0)
+			return -1;
+		usbindex_valid = usbindex_follow;
+	}
+	for (i = 0; i < usbindex_count; i++) {
+		if (usbindex_match(&usbindex[i], vid, pid, serial)) {
+			*found = usbindex[i];
+			usbindex_last_save(found);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void usbindex_track(void)
+{
+	usbindex_follow = 1;
+}
+
+void usbindex_uevent(int action, const char *devpath)
+{
+	const char *name = strrchr(devpath, '/');
+	int i;
+
+	if (!usbindex_valid)
+		return;
+	name = name ? name + 1 : devpath;
+	for (i = 0; i < usbindex_count; i++) {
+		if (strcmp(usbindex[i].path, name) == 0)
+			break;
+	}
+	if (action == HOTPLUG_DETACH) {
+		if (i < usbindex_count)
+			usbindex[i] = usbindex[--usbindex_count];
+		return;
+	}
+	if (i == usbindex_count && usbindex_count == USBINDEX_MAX) {
+		// Full: fall back to a rescan on the next lookup
+		usbindex_valid = 0;
+		return;
+	}
+	if (usbindex_read(name, &usbindex[i]) == 0 && i == usbindex_count)
+		usbindex_count++;
+}
+
+#else
+
+int usbindex_lookup(uint16_t vid, uint16_t pid, const char *serial, struct usbindex_entry *found)
+{
+	(void)vid;
+	(void)pid;
+	(void)serial;
+	(void)found;
+	return -1;
+}
+
+void usbindex_track(void)
+{
+}
+
+void usbindex_uevent(int action, const char *devpath)
+{
+	(void)action;
+	(void)devpath;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SYSFS_H
+#define SYSFS_H
+
+#include <stdint.h>
+
+/**
+* sysfs device index: usbindex_lookup() returns 1 and the first device
+* matching VID/PID (and serial unless NULL), 0 when none is attached or -1
+* when there is no sysfs. After usbindex_track() the index is only updated
+* by the usbindex_uevent() calls of the hotplug listener.
+*/
+//@{
+struct usbindex_entry {
+	char path[32];      // bus path, the sysfs name such as "1-1.4"
+	int busnum;
+	int devnum;
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t bcd;
+	int speed;          // Mb/s, 0: unknown
+	char serial[64];
+};
+int usbindex_lookup(uint16_t vid, uint16_t pid, const char *serial, struct usbindex_entry *found);
+void usbindex_track(void);
+void usbindex_uevent(int action, const char *devpath);
+//@}
+
+#endif
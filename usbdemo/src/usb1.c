@@ -0,0 +1,749 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBUSB_1_0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libusb-1.0/libusb.h>
+#include "usbdemo.h"
+#include "stats.h"
+#include "iso.h"
+
+/**
+* libusb-1.0 backend
+*
+* Transfers are submitted asynchronously and completed by callbacks that
+* all run on one event thread, so the pipelined mode queues real URBs on
+* Linux instead of parking a thread in every blocking call. The demo loop
+* submits its OUT and IN transfers together and waits for both callbacks.
+*/
+//@{
+
+struct usb1_pipeline;
+
+struct usb1_pair {
+	struct usb1_pipeline *pipeline;
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	uint64_t start_ns;
+	atomic_int pending;  // transfers of the round trip still in flight
+	atomic_int failed;
+};
+
+struct usb1_pipeline {
+	atomic_int running;
+	int active;          // pairs still cycling, guarded by usb1_lock
+	struct lat_stats rtt;
+	atomic_ulong errors;
+};
+
+struct usb1_iso {
+	struct iso_stream stream; // counted on the event thread only
+	atomic_int running;
+	int active;          // transfers still cycling, guarded by usb1_lock
+};
+
+// Backing memory of the pipeline transfer buffers
+struct usb1_pool {
+	uint8_t *base;
+	size_t len;
+	int mapped;          // 1: usbfs mapping, 0: heap
+};
+
+// What one pipeline pass measured
+struct usb1_pass {
+	struct lat_stats rtt;
+	uint64_t elapsed;
+	uint64_t cpu;
+	unsigned long errors;
+};
+
+static libusb_context *usb1_ctx;
+static libusb_device_handle *usb1_handle;
+static int usb1_fd = -1;         // device node handed to libusb_wrap_sys_device()
+static pthread_t usb1_event_thread;
+static atomic_int usb1_stop;     // ends the event thread
+// Round trip transfers of the demo loop, allocated with the handle
+static struct libusb_transfer *usb1_loop_out;
+static struct libusb_transfer *usb1_loop_in;
+static pthread_mutex_t usb1_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb1_cond = PTHREAD_COND_INITIALIZER;
+
+//@}
+
+static void *usb1_event_main(void *arg)
+{
+	(void)arg;
+	while (!atomic_load(&usb1_stop)) {
+		struct timeval tv = { 0, 100000 };
+
+		libusb_handle_events_timeout_completed(usb1_ctx, &tv, NULL);
+	}
+	return NULL;
+}
+
+static void usb1_init(void)
+{
+	int ret;
+
+	printf("Initialization library \"libusb-1.0\"...\n");
+	if ((ret = libusb_init(&usb1_ctx)) < 0) {
+		printf("error: libusb_init: %s\n", libusb_error_name(ret));
+		exit(1);
+	}
+	if (pthread_create(&usb1_event_thread, NULL, usb1_event_main, NULL)) {
+		printf("error: cannot start event thread\n");
+		exit(1);
+	}
+}
+
+static int usb1_is_open(void)
+{
+	return usb1_handle != NULL;
+}
+
+static void usb1_drop(void)
+{
+	libusb_free_transfer(usb1_loop_out);
+	libusb_free_transfer(usb1_loop_in);
+	usb1_loop_out = usb1_loop_in = NULL;
+	libusb_close(usb1_handle);
+	usb1_handle = NULL;
+	if (usb1_fd >= 0) {
+		close(usb1_fd);
+		usb1_fd = -1;
+	}
+}
+
+static void usb1_close(void)
+{
+	libusb_release_interface(usb1_handle, 0);
+	usb1_drop();
+	clearendpoints();
+	devstrings_detach();
+}
+
+static void usb1_exit(void)
+{
+	if (usb1_handle != NULL)
+		usb1_close();
+	atomic_store(&usb1_stop, 1);
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(usb1_ctx);
+#endif
+	// Older libusb: the event wait ends within its 100 ms timeout
+	pthread_join(usb1_event_thread, NULL);
+	libusb_exit(usb1_ctx);
+	usb1_ctx = NULL;
+}
+
+static int usb1_events(pthread_t *thread)
+{
+	*thread = usb1_event_thread;
+	return 1;
+}
+
+// Without the index: enumerate, and with -n read each candidate's serial
+static libusb_device_handle *usb1_enumerate(void)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle = NULL;
+	libusb_device **list;
+	unsigned char serial[64];
+	ssize_t n, i;
+
+	n = libusb_get_device_list(usb1_ctx, &list);
+	for (i = 0; i < n; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) < 0
+			|| desc.idVendor != DEVICE_VENDOR_VID || desc.idProduct != DEVICE_VENDOR_PID)
+			continue;
+		if (libusb_open(list[i], &handle) < 0) {
+			handle = NULL;
+			continue;
+		}
+		if (opt_serial == NULL)
+			break;
+		if (desc.iSerialNumber
+			&& libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial)) > 0
+			&& strcmp((char *)serial, opt_serial) == 0)
+			break;
+		libusb_close(handle);
+		handle = NULL;
+	}
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return handle;
+}
+
+// Open the node the sysfs index points at, else let libusb enumerate
+static libusb_device_handle *usb1_find(void)
+{
+	libusb_device_handle *handle = NULL;
+#ifdef HAVE_LIBUSB_WRAP_SYS_DEVICE
+	struct usbindex_entry entry;
+	char path[64];
+
+	switch (usbindex_lookup(DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, opt_serial, &entry)) {
+	case 0:
+		return NULL;
+	case 1:
+		snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", entry.busnum, entry.devnum);
+		usb1_fd = open(path, O_RDWR | O_CLOEXEC);
+		if (usb1_fd >= 0 && libusb_wrap_sys_device(usb1_ctx, usb1_fd, &handle) == 0)
+			return handle;
+		if (usb1_fd >= 0)
+			close(usb1_fd);
+		usb1_fd = -1;
+		break;
+	}
+#endif
+	return usb1_enumerate();
+}
+
+static int usb1_open(void)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *altsetting;
+	libusb_device *dev;
+	uint8_t strings[DEVSTRING_COUNT], ports[8];
+	char path[32];
+	unsigned char value;
+	int i, n, len, active, alternate;
+
+	if (usb1_handle != NULL)
+		return 1;
+	printf("Opening\n");
+	usb1_handle = usb1_find();
+	if (usb1_handle == NULL) {
+		printf("Device not found\n");
+		return 0;
+	}
+	usb1_loop_out = libusb_alloc_transfer(0);
+	usb1_loop_in = libusb_alloc_transfer(0);
+	if (usb1_loop_out == NULL || usb1_loop_in == NULL) {
+		printf("error: out of memory\n");
+		usb1_drop();
+		return 0;
+	}
+	dev = libusb_get_device(usb1_handle);
+	libusb_get_device_descriptor(dev, &desc);
+	printf("Device open\n");
+	printf("- Device version: %d.%d\n", desc.bcdDevice >> 8, (desc.bcdDevice & 0xFF));
+	strings[DEVSTRING_MANUFACTURER] = desc.iManufacturer;
+	strings[DEVSTRING_PRODUCT] = desc.iProduct;
+	strings[DEVSTRING_SERIAL] = desc.iSerialNumber;
+	// Same bus path as the sysfs name: bus-port.port...
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	len = snprintf(path, sizeof(path), "%d-", libusb_get_bus_number(dev));
+	for (i = 0; i < n && len < (int)sizeof(path); i++)
+		len += snprintf(path + len, sizeof(path) - len, i ? ".%d" : "%d", ports[i]);
+	devstrings_attach(path, libusb_get_device_address(dev), desc.bcdDevice, strings);
+	switch (libusb_get_device_speed(dev)) {
+	case LIBUSB_SPEED_LOW:
+	case LIBUSB_SPEED_FULL:
+		device_high_speed = 0;
+		break;
+	case LIBUSB_SPEED_UNKNOWN:
+		device_high_speed = -1;
+		break;
+	default:
+		device_high_speed = 1;
+		break;
+	}
+
+	printf("Initialization device\n");
+	if (libusb_get_config_descriptor(dev, 0, &config) < 0) {
+		printf("error: reading config descriptor failed\n");
+		goto drop;
+	}
+	// Only send what the device needs, see openinterface()
+	open_requests = 0;
+	alternate = -1;
+	if (open_cold || libusb_get_configuration(usb1_handle, &active) < 0 || active != 1) {
+		if (libusb_set_configuration(usb1_handle, 1) < 0) {
+			printf("error: setting config 1 failed\n");
+			goto fail;
+		}
+		open_requests++;
+		alternate = 0;
+	}
+	if (libusb_claim_interface(usb1_handle, 0) < 0) {
+		printf("error: claiming interface 0 failed\n");
+		goto fail;
+	}
+	// Alternate setting 1 carries the isochronous bandwidth, see findendpoint()
+	altsetting = &config->interface[0].altsetting[config->interface[0].num_altsetting > 1 ? 1 : 0];
+	if (config->interface[0].num_altsetting > 1) {
+		if (alternate < 0 && !open_cold
+			&& libusb_control_transfer(usb1_handle, LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE,
+				LIBUSB_REQUEST_GET_INTERFACE, 0, 0, &value, 1, 1000) == 1)
+			alternate = value;
+		if (alternate != 1) {
+			if (libusb_set_interface_alt_setting(usb1_handle, 0, 1) < 0) {
+				printf("error: set alternate 1 interface 0 failed\n");
+				goto release;
+			}
+			open_requests++;
+		}
+	}
+	printf("Device ready\n");
+
+	printf("Searching endpoints\n");
+	for (i = 0; i < altsetting->bNumEndpoints; i++) {
+		addendpoint(altsetting->endpoint[i].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK,
+			altsetting->endpoint[i].bEndpointAddress,
+			altsetting->endpoint[i].wMaxPacketSize,
+			altsetting->endpoint[i].bInterval);
+	}
+	libusb_free_config_descriptor(config);
+	listendpoints();
+	return 1;
+
+	// Undo all of the open, a caller may well try again
+release:
+	libusb_release_interface(usb1_handle, 0);
+fail:
+	libusb_free_config_descriptor(config);
+drop:
+	devstrings_detach();
+	usb1_drop();
+	return 0;
+}
+
+static void LIBUSB_CALL usb1_done(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+
+	pthread_mutex_lock(&usb1_lock);
+	*completed = 1;
+	pthread_cond_broadcast(&usb1_cond);
+	pthread_mutex_unlock(&usb1_lock);
+}
+
+// Transfer status as the -errno libusb-0.1 would have returned
+static int usb1_errno(int status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -EOVERFLOW;
+	}
+	return -EIO;
+}
+
+// Error code of a failed submit as -errno
+static int usb1_submit_errno(int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_BUSY:
+		return -EBUSY;
+	}
+	return -EIO;
+}
+
+static int usb1_loop_back(void)
+{
+	struct libusb_transfer *out = usb1_loop_out;
+	struct libusb_transfer *in = usb1_loop_in;
+	unsigned timeout = rto_ms(&loop_rto);
+	uint64_t start = now_ns();
+	int out_done = 1, in_done = 1, out_error, ret;
+
+	// Both halves are in flight together, each may take the whole round trip
+	libusb_fill_interrupt_transfer(out, usb1_handle, udi_vendor_ep_interrupt_out,
+		udi_vendor_buf_out, udi_vendor_buf_size, usb1_done, &out_done, timeout);
+	libusb_fill_interrupt_transfer(in, usb1_handle, udi_vendor_ep_interrupt_in,
+		udi_vendor_buf_in, udi_vendor_buf_size, usb1_done, &in_done, timeout);
+
+	// Queue the read first so the echo finds it already waiting
+	in_done = 0;
+	if ((ret = libusb_submit_transfer(in)) < 0) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		return usb1_submit_errno(ret);
+	}
+	out_done = 0;
+	if ((out_error = libusb_submit_transfer(out)) < 0) {
+		out_done = 1;
+		libusb_cancel_transfer(in);
+	}
+	pthread_mutex_lock(&usb1_lock);
+	while (!out_done || !in_done)
+		pthread_cond_wait(&usb1_cond, &usb1_lock);
+	pthread_mutex_unlock(&usb1_lock);
+	// The IN half was only cancelled, the failure is the OUT endpoint's
+	if (out_error < 0) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_out;
+		ret = usb1_submit_errno(out_error);
+	}
+	else if (out->status != LIBUSB_TRANSFER_COMPLETED) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_out;
+		ret = usb1_errno(out->status);
+	}
+	else if (in->status != LIBUSB_TRANSFER_COMPLETED) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		ret = usb1_errno(in->status);
+	}
+	else if (in->actual_length < udi_vendor_buf_size) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		ret = -EREMOTEIO;
+	}
+	else {
+		ret = 0;
+	}
+	rto_update(&loop_rto, now_ns() - start, ret);
+	return ret;
+}
+
+/**
+* With map the buffers come from libusb_dev_mem_alloc(), which mmaps
+* DMA-capable memory from usbfs. The kernel then hands user buffers to the
+* host controller as they are instead of copying each transfer in and out.
+* Kernels or libusb versions without the mapping get heap memory.
+*/
+static int usb1_pool_alloc(struct usb1_pool *pool, size_t len, int map)
+{
+	pool->len = len;
+	pool->mapped = 0;
+	pool->base = NULL;
+#ifdef HAVE_LIBUSB_DEV_MEM_ALLOC
+	if (map) {
+		pool->base = libusb_dev_mem_alloc(usb1_handle, len);
+		pool->mapped = pool->base != NULL;
+	}
+#endif
+	if (pool->base == NULL)
+		pool->base = malloc(len);
+	return pool->base ? 0 : -1;
+}
+
+static void usb1_pool_free(struct usb1_pool *pool)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM_ALLOC
+	if (pool->mapped) {
+		libusb_dev_mem_free(usb1_handle, pool->base, pool->len);
+		return;
+	}
+#endif
+	free(pool->base);
+}
+
+// Queue both halves of a round trip, IN first; -1 when nothing is in flight
+static int usb1_pair_submit(struct usb1_pair *pair)
+{
+	pair->start_ns = now_ns();
+	atomic_store(&pair->failed, 0);
+	atomic_store(&pair->pending, 2);
+	if (libusb_submit_transfer(pair->in) < 0) {
+		atomic_fetch_add(&pair->pipeline->errors, 1);
+		return -1;
+	}
+	if (libusb_submit_transfer(pair->out) < 0) {
+		atomic_fetch_add(&pair->pipeline->errors, 1);
+		atomic_store(&pair->failed, 1);
+		libusb_cancel_transfer(pair->in);
+		// The IN callback finishes the pair unless it already ran
+		if (atomic_fetch_sub(&pair->pending, 1) == 1)
+			return -1;
+	}
+	return 0;
+}
+
+static void usb1_pair_stop(struct usb1_pipeline *p)
+{
+	pthread_mutex_lock(&usb1_lock);
+	p->active--;
+	pthread_cond_broadcast(&usb1_cond);
+	pthread_mutex_unlock(&usb1_lock);
+}
+
+// Runs on the event thread, the only writer of the latency counters
+static void LIBUSB_CALL usb1_pair_done(struct libusb_transfer *transfer)
+{
+	struct usb1_pair *pair = transfer->user_data;
+	struct usb1_pipeline *p = pair->pipeline;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !atomic_exchange(&pair->failed, 1))
+		atomic_fetch_add(&p->errors, 1);
+	if (atomic_fetch_sub(&pair->pending, 1) != 1)
+		return;
+	if (atomic_load(&pair->failed)) {
+		usb1_pair_stop(p);
+		return;
+	}
+	lat_add(&p->rtt, now_ns() - pair->start_ns);
+	if (!atomic_load(&p->running) || usb1_pair_submit(pair)) {
+		usb1_pair_stop(p);
+	}
+}
+
+// One pipelined run of seconds, from mapped buffers with map: 0, -1 on
+// errors, 1 without a run when the mapping is not available
+static int usb1_pipeline_pass(int depth, int seconds, int map, struct usb1_pass *r)
+{
+	struct usb1_pipeline p;
+	struct usb1_pair *pairs;
+	struct usb1_pool pool;
+	uint64_t start, cpu;
+	int size = udi_vendor_buf_size;
+	int i, failed = 0;
+
+	pairs = calloc(depth, sizeof(*pairs));
+	if (pairs == NULL || usb1_pool_alloc(&pool, (size_t)2 * depth * size, map)) {
+		printf("error: out of memory\n");
+		free(pairs);
+		return -1;
+	}
+	if (map && !pool.mapped) {
+		usb1_pool_free(&pool);
+		free(pairs);
+		return 1;
+	}
+	memset(&p, 0, sizeof(p));
+	lat_reset(&p.rtt);
+	atomic_init(&p.running, 1);
+	atomic_init(&p.errors, 0);
+	for (i = 0; i < depth; i++) {
+		pairs[i].pipeline = &p;
+		pairs[i].out = libusb_alloc_transfer(0);
+		pairs[i].in = libusb_alloc_transfer(0);
+		if (pairs[i].out == NULL || pairs[i].in == NULL) {
+			failed = 1;
+			break;
+		}
+		libusb_fill_interrupt_transfer(pairs[i].out, usb1_handle, udi_vendor_ep_interrupt_out,
+			pool.base + (size_t)2 * i * size, size, usb1_pair_done, &pairs[i], 1000);
+		libusb_fill_interrupt_transfer(pairs[i].in, usb1_handle, udi_vendor_ep_interrupt_in,
+			pool.base + (size_t)(2 * i + 1) * size, size, usb1_pair_done, &pairs[i], 1000);
+		memcpy(pairs[i].out->buffer, udi_vendor_buf_out, size);
+	}
+
+	printf("Asynchronous interrupt loop back, %d bytes, depth %d, %d s, %s buffers\n",
+		size, depth, seconds, pool.mapped ? "usbfs mapped" : "heap");
+	start = now_ns();
+	cpu = cpu_ns();
+	for (i = 0; !failed && i < depth; i++) {
+		pthread_mutex_lock(&usb1_lock);
+		p.active++;
+		pthread_mutex_unlock(&usb1_lock);
+		if (usb1_pair_submit(&pairs[i])) {
+			usb1_pair_stop(&p);
+			failed = 1;
+		}
+	}
+	sleep(seconds);
+	atomic_store(&p.running, 0);
+	pthread_mutex_lock(&usb1_lock);
+	while (p.active)
+		pthread_cond_wait(&usb1_cond, &usb1_lock);
+	pthread_mutex_unlock(&usb1_lock);
+	r->elapsed = now_ns() - start;
+	r->cpu = cpu_ns() - cpu;
+	r->rtt = p.rtt;
+	r->errors = atomic_load(&p.errors);
+
+	for (i = 0; i < depth; i++) {
+		libusb_free_transfer(pairs[i].out);
+		libusb_free_transfer(pairs[i].in);
+	}
+	usb1_pool_free(&pool);
+	free(pairs);
+
+	printf("- Transfers: %llu (%.1f/s), errors: %lu\n",
+		(unsigned long long)r->rtt.count, r->rtt.count * 1e9 / r->elapsed, r->errors);
+	lat_print("Round trip", &r->rtt);
+	cpu_print(r->cpu, r->elapsed, r->rtt.count);
+	return (failed || r->errors) ? -1 : 0;
+}
+
+static double usb1_pass_cpu_us(const struct usb1_pass *r)
+{
+	return r->rtt.count ? r->cpu / 1e3 / r->rtt.count : 0.0;
+}
+
+static double usb1_pass_rtt_us(const struct usb1_pass *r)
+{
+	return r->rtt.count ? r->rtt.sum_ns / 1e3 / r->rtt.count : 0.0;
+}
+
+/**
+* With -z the same pipeline runs twice, from heap buffers and then from
+* usbfs mapped ones, and the two are compared: what the mapping saves is
+* only what the measurements show.
+*/
+static int usb1_pipeline(int depth, int seconds)
+{
+	struct usb1_pass heap, mapped;
+
+	if (depth < 1 || seconds < 1) {
+		printf("error: depth and duration must be positive\n");
+		return -1;
+	}
+	if (usb1_pipeline_pass(depth, seconds, 0, &heap))
+		return -1;
+	if (!opt_zerocopy)
+		return 0;
+	switch (usb1_pipeline_pass(depth, seconds, 1, &mapped)) {
+	case 1:
+		printf("warning: usbfs buffer mapping not available, nothing to compare\n");
+		return 0;
+	case -1:
+		return -1;
+	}
+	printf("Heap against usbfs mapped buffers\n");
+	printf("- Round trip avg: %.1f us against %.1f us\n", usb1_pass_rtt_us(&heap), usb1_pass_rtt_us(&mapped));
+	printf("- CPU per transfer: %.2f us against %.2f us\n", usb1_pass_cpu_us(&heap), usb1_pass_cpu_us(&mapped));
+	return 0;
+}
+
+// Runs on the event thread, which is the only one counting and filling the ring
+static void LIBUSB_CALL usb1_iso_done(struct libusb_transfer *transfer)
+{
+	struct usb1_iso *iso = transfer->user_data;
+	struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[0];
+	int status;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		status = usb1_errno(transfer->status);
+	else if (desc->status != LIBUSB_TRANSFER_COMPLETED)
+		status = usb1_errno(desc->status);
+	else
+		status = desc->actual_length;
+	if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+			iso_stream_in(&iso->stream, libusb_get_iso_packet_buffer_simple(transfer, 0), status);
+		else
+			iso_stream_out(&iso->stream, status);
+	}
+	if (atomic_load(&iso->running) && transfer->status != LIBUSB_TRANSFER_NO_DEVICE
+		&& transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN))
+			iso_stream_stamp(&iso->stream, transfer->buffer);
+		if (libusb_submit_transfer(transfer) == 0)
+			return;
+	}
+	pthread_mutex_lock(&usb1_lock);
+	iso->active--;
+	pthread_cond_broadcast(&usb1_cond);
+	pthread_mutex_unlock(&usb1_lock);
+}
+
+/**
+* Isochronous streaming on libusb-1.0: every queued packet is its own
+* transfer, resubmitted from its callback, so the packets keep flowing
+* without the main thread and complete in bus order on the event thread.
+*/
+static int usb1_iso(int depth, int seconds)
+{
+	struct usb1_iso iso;
+	struct libusb_transfer **xfers;
+	uint8_t *bufs;
+	int pktsize = udi_vendor_ep_iso_size, count = 2 * depth;
+	int i, ret, failed = 0;
+
+	if (depth < 1 || seconds < 1 || pktsize < (int)sizeof(uint32_t)) {
+		printf("error: bad depth, duration or isochronous packet size\n");
+		return -1;
+	}
+	xfers = calloc(count, sizeof(*xfers));
+	bufs = calloc(count, pktsize);
+	if (xfers == NULL || bufs == NULL) {
+		printf("error: out of memory\n");
+		free(xfers);
+		free(bufs);
+		return -1;
+	}
+	if (iso_stream_start(&iso.stream, pktsize)) {
+		free(xfers);
+		free(bufs);
+		return -1;
+	}
+	atomic_init(&iso.running, 1);
+	iso.active = 0;
+	for (i = 0; i < count; i++) {
+		// Even transfers write, odd ones read the echo
+		unsigned char ep = (i & 1) ? udi_vendor_ep_iso_in : udi_vendor_ep_iso_out;
+
+		xfers[i] = libusb_alloc_transfer(1);
+		if (xfers[i] == NULL) {
+			failed = 1;
+			break;
+		}
+		libusb_fill_iso_transfer(xfers[i], usb1_handle, ep, bufs + (size_t)i * pktsize, pktsize, 1,
+			usb1_iso_done, &iso, 1000);
+		libusb_set_iso_packet_lengths(xfers[i], pktsize);
+		// Numbered before any is queued, the callbacks number the rest
+		if (!(i & 1))
+			iso_stream_stamp(&iso.stream, xfers[i]->buffer);
+	}
+
+	printf("Isochronous streaming, %d bytes per packet, %d packets queued per direction, %d s\n",
+		pktsize, depth, seconds);
+	for (i = 0; !failed && i < count; i++) {
+		pthread_mutex_lock(&usb1_lock);
+		iso.active++;
+		pthread_mutex_unlock(&usb1_lock);
+		if ((ret = libusb_submit_transfer(xfers[i])) < 0) {
+			printf("error: isochronous submit failed: %s\n", libusb_error_name(ret));
+			pthread_mutex_lock(&usb1_lock);
+			iso.active--;
+			pthread_mutex_unlock(&usb1_lock);
+			failed = 1;
+		}
+	}
+	if (!failed)
+		sleep(seconds);
+	atomic_store(&iso.running, 0);
+	pthread_mutex_lock(&usb1_lock);
+	while (iso.active)
+		pthread_cond_wait(&usb1_cond, &usb1_lock);
+	pthread_mutex_unlock(&usb1_lock);
+
+	if (iso_stream_finish(&iso.stream))
+		failed = 1;
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(xfers[i]);
+	free(xfers);
+	free(bufs);
+	return failed ? -1 : 0;
+}
+
+static int usb1_get_string(unsigned char index, char *buf, int size)
+{
+	return libusb_get_string_descriptor_ascii(usb1_handle, index, (unsigned char *)buf, size);
+}
+
+static int usb1_clear_halt(unsigned char ep)
+{
+	return libusb_clear_halt(usb1_handle, ep) < 0 ? -1 : 0;
+}
+
+static int usb1_reset(void)
+{
+	// NOT_FOUND: the device came back different and needs a reopen
+	return libusb_reset_device(usb1_handle) < 0 ? -1 : 0;
+}
+
+const struct backend backend_usb1 = {
+	"usb1", usb1_init, usb1_open, usb1_is_open, usb1_close, usb1_loop_back, usb1_pipeline,
+	usb1_get_string, usb1_clear_halt, usb1_reset, usb1_iso, usb1_exit, usb1_events,
+};
+
+#endif
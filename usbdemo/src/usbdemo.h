@@ -0,0 +1,198 @@
+#ifndef USBDEMO_H
+#define USBDEMO_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <usb.h>
+#include "rto.h"
+#include "sysfs.h"
+
+/**
+* Device vendor definition
+*/
+//@{
+
+#define DEVICE_VENDOR_VID 0x03eb
+#define DEVICE_VENDOR_PID 0x2423
+
+// fallback transfer size when no endpoint size is known
+#define  UDI_VENDOR_LOOPBACK_SIZE    12
+
+// bRequest of the control loop back, OUT stores the data stage, IN returns it
+#define  UDI_VENDOR_REQUEST_LOOPBACK 0
+
+// the device's endpoints
+extern unsigned char udi_vendor_ep_interrupt_in;
+extern unsigned char udi_vendor_ep_interrupt_out;
+extern unsigned char udi_vendor_ep_bulk_in;
+extern unsigned char udi_vendor_ep_bulk_out;
+extern unsigned char udi_vendor_ep_iso_in;
+extern unsigned char udi_vendor_ep_iso_out;
+extern unsigned short udi_vendor_ep_interrupt_size;
+extern unsigned short udi_vendor_ep_bulk_size;
+extern unsigned short udi_vendor_ep_iso_size;
+extern unsigned char udi_vendor_ep_failed; // endpoint of the last failed transfer, 0: unknown
+extern unsigned char udi_vendor_ep_interrupt_interval; // bInterval
+extern int device_high_speed; // 1: high speed or faster, 0: full or low speed, -1: unknown
+
+// bytes an endpoint moves per packet from its wMaxPacketSize, high-bandwidth included
+unsigned short ep_packet_size(unsigned short wMaxPacketSize);
+
+extern usb_dev_handle *device_handle; // the device handle
+
+extern uint8_t *udi_vendor_buf_out;
+extern uint8_t *udi_vendor_buf_in;
+extern int udi_vendor_buf_size;
+
+extern int opt_zerocopy; // -z: usbfs mapped transfer buffers
+extern const char *opt_serial; // -n: serial number to match, NULL: any
+
+//@}
+
+#ifdef USBEMU
+/**
+* libusb-win32 asynchronous API, also provided by the emulated device
+*/
+//@{
+int usb_isochronous_setup_async(usb_dev_handle *dev, void **context, unsigned char ep, int pktsize);
+int usb_submit_async(void *context, char *bytes, int size);
+int usb_reap_async(void *context, int timeout);
+int usb_cancel_async(void *context);
+int usb_free_async(void **context);
+//@}
+#endif
+
+/**
+* Transfer backend: how the demo loop and the pipelined mode reach the device
+*/
+struct backend {
+	const char *name;
+	void (*init)(void);
+	int (*open)(void);                       // find, open and configure, 1 when ready
+	int (*is_open)(void);
+	void (*close)(void);
+	int (*loop_back)(void);                  // one interrupt round trip, 0 or -errno, timeout from loop_rto
+	int (*pipeline)(int depth, int seconds); // see pipeline_run()
+	int (*get_string)(unsigned char index, char *buf, int size); // ASCII string descriptor, <0 on error
+	int (*clear_halt)(unsigned char ep);
+	int (*reset)(void);                      // port reset, the handle stays open
+	int (*iso)(int depth, int seconds);      // see iso_run(), NULL: no isochronous transfers
+	void (*exit)(void);                      // closes the device, undoes init(); NULL: nothing to undo
+	int (*event_thread)(pthread_t *thread);  // 1 and the thread completing transfers; NULL or 0: the caller's
+};
+
+extern const struct backend backend_usb0;
+extern const struct backend backend_usb1;
+extern const struct backend backend_usbfs;
+extern const struct backend *backend;
+
+extern int open_cold;     // send SET_CONFIGURATION/SET_INTERFACE even when not needed
+extern int open_requests; // SET_CONFIGURATION/SET_INTERFACE sent by the last open
+
+int opendevice(void);
+void transfer(void);
+void addendpoint(unsigned char ep_type, unsigned char ep_add, unsigned short wMaxPacketSize,
+	unsigned char bInterval);
+void listendpoints(void);
+void clearendpoints(void);
+uint64_t interrupt_interval_ns(void); // service interval of the interrupt endpoints, 0: unknown
+int loop_back_interrupt(usb_dev_handle *device_handle);
+extern struct rto loop_rto; // timeout of backend->loop_back(), fed by every backend
+int loop_back_control(usb_dev_handle *device_handle);
+
+/**
+* Tiered recovery after backend->loop_back() returned error: retry, clear
+* halt, reset, reopen. Returns 0 once a loop back succeeded again, -1 when
+* the device had to be closed.
+*/
+int recover(int error);
+extern int recover_quiet;   // no report on every recovery
+
+/**
+* Recovery benchmark: loop backs for the given seconds against a failing
+* device, reporting time to recover per kind of fault and lost transfers.
+*/
+int recover_run(int seconds);
+
+/**
+* Hotplug notification: hotplug_open() returns a descriptor, or -1 when the
+* platform has none. hotplug_wait() blocks up to timeout ms (-1: forever,
+* 0: only what is already queued)
+* and returns HOTPLUG_ATTACH or HOTPLUG_DETACH for the vendor device, 0 on
+* timeout or signal, -1 on error.
+*/
+//@{
+#define HOTPLUG_ATTACH 1
+#define HOTPLUG_DETACH 2
+int hotplug_open(void);
+int hotplug_wait(int fd, int timeout);
+//@}
+
+/**
+* String descriptor cache: backends call devstrings_attach() when a device
+* opens, devstring() reads a string through the backend on first use only.
+*/
+//@{
+enum { DEVSTRING_MANUFACTURER, DEVSTRING_PRODUCT, DEVSTRING_SERIAL, DEVSTRING_COUNT };
+void devstrings_attach(const char *path, int devnum, uint16_t bcd, const uint8_t index[DEVSTRING_COUNT]);
+void devstrings_detach(void);
+const char *devstring(int which);
+void devstrings_print(void);
+//@}
+
+/**
+* Pipelined interrupt loopback: keeps depth OUT/IN round trips in flight
+* on the interrupt endpoints for the given number of seconds.
+*/
+int pipeline_run(usb_dev_handle *handle, int depth, int seconds);
+
+/**
+* Bulk streaming: keeps buffers transfers of size bytes queued in each
+* direction of the bulk endpoints and reports sustained MB/s.
+*/
+int bulk_run(usb_dev_handle *handle, int size, int buffers, int seconds);
+
+/**
+* Isochronous streaming: keeps depth packets queued in each direction of the
+* isochronous endpoints and hands received packets to a consumer thread.
+* Needs the libusb-win32 asynchronous API, see iso.h; the usb1 backend has
+* its own.
+*/
+int iso_run(usb_dev_handle *handle, int depth, int seconds);
+
+/**
+* Control loop back: times vendor OUT/IN requests on endpoint 0, then the
+* same payload over the interrupt endpoints for comparison.
+*/
+int control_run(usb_dev_handle *handle, int seconds);
+
+/**
+* Full-duplex interrupt I/O: independent writer and reader threads, with
+* throughput and latency counted per direction.
+*/
+int duplex_run(usb_dev_handle *handle, int seconds);
+
+/**
+* Multi-device loop back: opens every vendor device with a context of its
+* own and drives them from a work-stealing pool of workers (0: one per
+* core), reporting per-device and aggregate throughput.
+*/
+int multi_run(int size, int workers, int seconds);
+
+/**
+* Real-time latency: interrupt loop backs under default scheduling, then
+* locked, pre-faulted, SCHED_FIFO and pinned to cpu (-1: the CPU of the
+* host controller interrupt), with both latency distributions reported.
+*/
+int rt_run(int cpu, int seconds);
+
+/**
+* Benchmark sweep: every combination of the comma separated endpoint types
+* (interrupt, bulk, control), sizes and depths runs after a warm-up for
+* the given seconds; throughput, latency percentiles and CPU time go to
+* output as CSV, or JSON for a .json name (NULL: standard output).
+*/
+int bench_run(usb_dev_handle *handle, const char *types, const char *sizes, const char *depths,
+	int seconds, const char *output);
+
+#endif
@@ -0,0 +1,569 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_LINUX_USBDEVICE_FS_H) && defined(HAVE_SYS_EPOLL_H) && !defined(USBEMU)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/usbdevice_fs.h>
+#include "usbdemo.h"
+#include "stats.h"
+
+/**
+* Direct usbfs backend
+*
+* Talks to /dev/bus/usb/BBB/DDD without libusb. URBs are submitted with
+* USBDEVFS_SUBMITURB and reaped with USBDEVFS_REAPURBNDELAY once epoll
+* reports the file writable, which usbfs does while completions are
+* waiting. One epoll_wait can therefore collect a whole batch of
+* completions, where the blocking libusb-0.1 calls pay a submit plus a
+* sleeping reap for every transfer.
+*/
+//@{
+
+#define USBFS_ROOT      "/dev/bus/usb"
+#define USBFS_TIMEOUT   1000 // ms without any completion before URBs are discarded
+
+struct usbfs_pair {
+	struct usbdevfs_urb out;
+	struct usbdevfs_urb in;
+	uint64_t start_ns;
+	unsigned queued;         // USBFS_QUEUED_*: URBs of the round trip not reaped yet
+	int failed;
+};
+
+#define USBFS_QUEUED_IN     1
+#define USBFS_QUEUED_OUT    2
+
+static int usbfs_fd = -1;
+static int usbfs_epoll = -1;
+
+//@}
+
+static void usbfs_fill(struct usbdevfs_urb *urb, unsigned char ep, void *buf, int size, void *context)
+{
+	memset(urb, 0, sizeof(*urb));
+	urb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+	urb->endpoint = ep;
+	urb->buffer = buf;
+	urb->buffer_length = size;
+	urb->usercontext = context;
+}
+
+static int usbfs_submit(struct usbdevfs_urb *urb)
+{
+	return ioctl(usbfs_fd, USBDEVFS_SUBMITURB, urb);
+}
+
+/**
+* Wait up to timeout ms for completions and reap all of them, at most max.
+* Returns the number of URBs reaped, 0 on timeout or -1 on error.
+*/
+static int usbfs_reap(struct usbdevfs_urb **urbs, int max, int timeout)
+{
+	struct epoll_event ev;
+	void *urb;
+	int n = 0, ret;
+
+	while (n == 0) {
+		ret = epoll_wait(usbfs_epoll, &ev, 1, timeout);
+		if (ret == 0)
+			return 0;
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		while (n < max) {
+			if (ioctl(usbfs_fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+				if (errno == EAGAIN)
+					break;
+				return -1;
+			}
+			urbs[n++] = urb;
+		}
+	}
+	return n;
+}
+
+/**
+* Take back the n submitted URBs not reaped yet, before their buffers go
+* away: discard them all, then reap until every one has come back. A URB
+* that already completed cannot be discarded (EINVAL), it still waits on
+* the completion list with a pointer to its buffer and is reaped all the
+* same. The array is reordered. Returns 0, or -1 when the kernel has no
+* more to hand back, a disconnect drops the URBs with the device.
+*/
+static int usbfs_drain(struct usbdevfs_urb **urbs, int n)
+{
+	struct usbdevfs_urb *reaped;
+	int i;
+
+	for (i = 0; i < n; i++)
+		ioctl(usbfs_fd, USBDEVFS_DISCARDURB, urbs[i]);
+	while (n > 0) {
+		if (ioctl(usbfs_fd, USBDEVFS_REAPURB, &reaped) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		// Every URB in flight is in the array, nothing else can come back
+		for (i = 0; i < n && urbs[i] != reaped; i++)
+			;
+		if (i < n)
+			urbs[i] = urbs[--n];
+	}
+	return 0;
+}
+
+static int usbfs_string(unsigned char index, char *string, int size)
+{
+	unsigned char desc[255];
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = USB_ENDPOINT_IN,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = (USB_DT_STRING << 8) | index,
+		.wIndex = 0x0409,
+		.wLength = sizeof(desc),
+		.timeout = 1000,
+		.data = desc,
+	};
+	int len, i, n = 0;
+
+	len = ioctl(usbfs_fd, USBDEVFS_CONTROL, &ctrl);
+	if (len < 2 || desc[1] != USB_DT_STRING)
+		return -1;
+	if (desc[0] < len)
+		len = desc[0];
+	// UTF-16LE to ASCII, like usb_get_string_simple()
+	for (i = 2; i + 1 < len && n < size - 1; i += 2)
+		string[n++] = desc[i + 1] ? '?' : desc[i];
+	string[n] = 0;
+	return n;
+}
+
+/**
+* Read the descriptors usbfs returns for an open device node. When it is the
+* vendor device, print it and record the endpoints of interface 0, alternate
+* setting 1 when there is one. Returns 0 for any other device, else 1 plus
+* the alternate setting to select. path and devnum identify the device for
+* the string cache.
+*/
+static int usbfs_probe(const uint8_t *desc, int len, const char *path, int devnum)
+{
+	uint8_t strings[DEVSTRING_COUNT];
+	int i, alt = 0, cur_if = -1, cur_alt = -1;
+
+	if (len < USB_DT_DEVICE_SIZE
+		|| (desc[8] | desc[9] << 8) != DEVICE_VENDOR_VID
+		|| (desc[10] | desc[11] << 8) != DEVICE_VENDOR_PID)
+		return 0;
+
+	printf("Device open\n");
+	printf("- Device version: %d.%d\n", desc[13], desc[12]);
+	strings[DEVSTRING_MANUFACTURER] = desc[14];
+	strings[DEVSTRING_PRODUCT] = desc[15];
+	strings[DEVSTRING_SERIAL] = desc[16];
+	devstrings_attach(path, devnum, desc[12] | desc[13] << 8, strings);
+
+	// First configuration only, like openinterface()
+	for (i = desc[0]; i + 1 < len && desc[i] >= 2; i += desc[i]) {
+		if (desc[i + 1] == USB_DT_CONFIG && i > desc[0])
+			break;
+		if (desc[i + 1] == USB_DT_INTERFACE && desc[i + 2] == 0 && desc[i + 3] == 1)
+			alt = 1;
+	}
+	printf("Searching endpoints\n");
+	for (i = desc[0]; i + 1 < len && desc[i] >= 2; i += desc[i]) {
+		if (desc[i + 1] == USB_DT_CONFIG && i > desc[0])
+			break;
+		if (desc[i + 1] == USB_DT_INTERFACE) {
+			cur_if = desc[i + 2];
+			cur_alt = desc[i + 3];
+		}
+		else if (desc[i + 1] == USB_DT_ENDPOINT && cur_if == 0 && cur_alt == alt && i + 5 < len) {
+			addendpoint(desc[i + 3] & USB_ENDPOINT_TYPE_MASK, desc[i + 2], desc[i + 4] | desc[i + 5] << 8,
+				i + 6 < len ? desc[i + 6] : 0);
+		}
+	}
+	return alt + 1;
+}
+
+// Standard GET_CONFIGURATION/GET_INTERFACE, -1 when the device does not answer
+static int usbfs_get_state(int recipient, int request)
+{
+	unsigned char value;
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = USB_ENDPOINT_IN | USB_TYPE_STANDARD | recipient,
+		.bRequest = request,
+		.wLength = 1,
+		.timeout = 1000,
+		.data = &value,
+	};
+
+	if (ioctl(usbfs_fd, USBDEVFS_CONTROL, &ctrl) != 1)
+		return -1;
+	return value;
+}
+
+static int usbfs_openinterface(int alt)
+{
+	struct usbdevfs_setinterface setif = { 0, 1 };
+	unsigned int config = 1, interface = 0;
+	int alternate = -1;
+
+	printf("Initialization device\n");
+	// Only send what the device needs, see openinterface()
+	open_requests = 0;
+	if (open_cold || usbfs_get_state(USB_RECIP_DEVICE, USB_REQ_GET_CONFIGURATION) != 1) {
+		// EBUSY: another interface of the configuration is bound, keep it
+		if (ioctl(usbfs_fd, USBDEVFS_SETCONFIGURATION, &config) < 0 && errno != EBUSY) {
+			printf("error: setting config 1 failed\n");
+			return 0;
+		}
+		open_requests++;
+		alternate = 0;
+	}
+	if (ioctl(usbfs_fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+		printf("error: claiming interface 0 failed\n");
+		return 0;
+	}
+	if (alt > 1) {
+		if (alternate < 0 && !open_cold)
+			alternate = usbfs_get_state(USB_RECIP_INTERFACE, USB_REQ_GET_INTERFACE);
+		if (alternate != 1) {
+			if (ioctl(usbfs_fd, USBDEVFS_SETINTERFACE, &setif) < 0) {
+				printf("error: set alternate 1 interface 0 failed\n");
+				return 0;
+			}
+			open_requests++;
+		}
+	}
+	printf("Device ready\n");
+	return 1;
+}
+
+static void usbfs_init(void)
+{
+	printf("Initialization library \"usbfs\"...\n");
+	usbfs_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (usbfs_epoll < 0) {
+		printf("error: epoll_create1: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static int usbfs_is_open(void)
+{
+	return usbfs_fd >= 0;
+}
+
+static void usbfs_close(void)
+{
+	unsigned int interface = 0;
+
+	ioctl(usbfs_fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	close(usbfs_fd); // also drops it from the epoll set
+	usbfs_fd = -1;
+	clearendpoints();
+	devstrings_detach();
+}
+
+// Open one device node, it stays open in usbfs_fd when it is the vendor device
+static int usbfs_try(const char *node, const char *path)
+{
+	uint8_t desc[4096];
+	int fd, len, alt;
+
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, desc, sizeof(desc));
+	usbfs_fd = fd;
+	// The node is named after the device number: .../BBB/DDD
+	alt = usbfs_probe(desc, len, path, atoi(strrchr(node, '/') + 1));
+	if (!alt) {
+		close(fd);
+		usbfs_fd = -1;
+	}
+	return alt;
+}
+
+// Walk every device node, for when there is no sysfs index
+static int usbfs_scan(void)
+{
+	char path[sizeof(USBFS_ROOT) + 2 * 256];
+	struct dirent *b, *d;
+	DIR *busdir, *devdir;
+	int alt = 0;
+
+	busdir = opendir(USBFS_ROOT);
+	if (busdir == NULL) {
+		printf("error: %s: %s\n", USBFS_ROOT, strerror(errno));
+		return 0;
+	}
+	while (!alt && (b = readdir(busdir)) != NULL) {
+		if (b->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", USBFS_ROOT, b->d_name);
+		devdir = opendir(path);
+		if (devdir == NULL)
+			continue;
+		while (!alt && (d = readdir(devdir)) != NULL) {
+			if (d->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/%s", USBFS_ROOT, b->d_name, d->d_name);
+			alt = usbfs_try(path, path + sizeof(USBFS_ROOT));
+		}
+		closedir(devdir);
+	}
+	closedir(busdir);
+	return alt;
+}
+
+static int usbfs_open(void)
+{
+	struct epoll_event ev = { .events = EPOLLOUT };
+	struct usbindex_entry entry;
+	char path[sizeof(USBFS_ROOT) + 32];
+	int alt = 0, speed;
+
+	if (usbfs_fd >= 0)
+		return 1;
+	printf("Opening\n");
+	switch (usbindex_lookup(DEVICE_VENDOR_VID, DEVICE_VENDOR_PID, opt_serial, &entry)) {
+	case 1:
+		snprintf(path, sizeof(path), "%s/%03d/%03d", USBFS_ROOT, entry.busnum, entry.devnum);
+		alt = usbfs_try(path, entry.path);
+		break;
+	case -1:
+		alt = usbfs_scan();
+		break;
+	}
+	if (!alt) {
+		printf("Device not found\n");
+		return 0;
+	}
+	if (!usbfs_openinterface(alt) || epoll_ctl(usbfs_epoll, EPOLL_CTL_ADD, usbfs_fd, &ev) < 0) {
+		// Closing also releases the interface, undo the rest of the open
+		close(usbfs_fd);
+		usbfs_fd = -1;
+		clearendpoints();
+		devstrings_detach();
+		return 0;
+	}
+#ifdef USBDEVFS_GET_SPEED
+	// enum usb_device_speed, its header clashes with usb.h: 0 unknown, 3 high
+	speed = ioctl(usbfs_fd, USBDEVFS_GET_SPEED);
+	device_high_speed = speed <= 0 ? -1 : speed >= 3;
+#else
+	device_high_speed = -1;
+#endif
+	listendpoints();
+	return 1;
+}
+
+// One round trip, both halves done within timeout ms of the submission
+static int usbfs_round_trip(unsigned timeout)
+{
+	struct usbdevfs_urb out, in, *done[2], *queued[2] = { &in, &out };
+	uint64_t deadline = now_ns() + (uint64_t)timeout * 1000000;
+	int pending, ret = 0, n, i, j;
+
+	usbfs_fill(&in, udi_vendor_ep_interrupt_in, udi_vendor_buf_in, udi_vendor_buf_size, NULL);
+	usbfs_fill(&out, udi_vendor_ep_interrupt_out, udi_vendor_buf_out, udi_vendor_buf_size, NULL);
+	// Queue the read first so the echo finds it already waiting
+	if (usbfs_submit(&in) < 0) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		return -errno;
+	}
+	if (usbfs_submit(&out) < 0) {
+		ret = -errno;
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_out;
+		usbfs_drain(queued, 1);
+		return ret;
+	}
+	// The URBs live in this frame: none may be left with the kernel on return
+	for (pending = 2; pending; ) {
+		uint64_t now = now_ns();
+
+		n = usbfs_reap(done, 2, now < deadline ? (int)((deadline - now + 999999) / 1000000) : 0);
+		if (n <= 0) {
+			ret = n < 0 ? -errno : -ETIMEDOUT;
+			usbfs_drain(queued, pending);
+			return ret;
+		}
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < pending && queued[j] != done[i]; j++)
+				;
+			if (j < pending)
+				queued[j] = queued[--pending];
+			if (done[i]->status < 0 && ret == 0) {
+				// URB status is already -errno, -EPIPE for a stall
+				ret = done[i]->status;
+				udi_vendor_ep_failed = done[i]->endpoint;
+				// The other half would only time out, it comes back cancelled
+				ioctl(usbfs_fd, USBDEVFS_DISCARDURB, done[i] == &in ? &out : &in);
+			}
+		}
+	}
+	if (ret == 0 && in.actual_length < udi_vendor_buf_size) {
+		udi_vendor_ep_failed = udi_vendor_ep_interrupt_in;
+		ret = -EREMOTEIO;
+	}
+	return ret;
+}
+
+static int usbfs_loop_back(void)
+{
+	uint64_t start = now_ns();
+	int ret = usbfs_round_trip(rto_ms(&loop_rto));
+
+	rto_update(&loop_rto, now_ns() - start, ret);
+	return ret;
+}
+
+static int usbfs_pair_submit(struct usbfs_pair *pair)
+{
+	pair->start_ns = now_ns();
+	pair->failed = 0;
+	pair->queued = 0;
+	if (usbfs_submit(&pair->in) < 0)
+		return -1;
+	pair->queued |= USBFS_QUEUED_IN;
+	if (usbfs_submit(&pair->out) < 0) {
+		// The IN URB comes back cancelled through the reap loop
+		pair->failed = 1;
+		ioctl(usbfs_fd, USBDEVFS_DISCARDURB, &pair->in);
+		return -1;
+	}
+	pair->queued |= USBFS_QUEUED_OUT;
+	return 0;
+}
+
+static int usbfs_pipeline(int depth, int seconds)
+{
+	struct usbfs_pair *pairs;
+	struct usbdevfs_urb **done;
+	struct lat_stats rtt;
+	unsigned long errors = 0, reaps = 0;
+	uint64_t start, end, elapsed, cpu;
+	uint8_t *bufs;
+	int size = udi_vendor_buf_size;
+	int active = 0, i, n;
+
+	if (depth < 1 || seconds < 1) {
+		printf("error: depth and duration must be positive\n");
+		return -1;
+	}
+	pairs = calloc(depth, sizeof(*pairs));
+	done = calloc(2 * depth, sizeof(*done));
+	bufs = malloc((size_t)2 * depth * size);
+	if (pairs == NULL || done == NULL || bufs == NULL) {
+		printf("error: out of memory\n");
+		free(pairs);
+		free(done);
+		free(bufs);
+		return -1;
+	}
+	lat_reset(&rtt);
+	for (i = 0; i < depth; i++) {
+		uint8_t *buf_out = bufs + (size_t)2 * i * size;
+
+		memcpy(buf_out, udi_vendor_buf_out, size);
+		usbfs_fill(&pairs[i].out, udi_vendor_ep_interrupt_out, buf_out, size, &pairs[i]);
+		usbfs_fill(&pairs[i].in, udi_vendor_ep_interrupt_in, buf_out + size, size, &pairs[i]);
+	}
+
+	printf("usbfs interrupt loop back, %d bytes, depth %d, %d s\n", size, depth, seconds);
+	start = now_ns();
+	cpu = cpu_ns();
+	end = start + seconds * 1000000000ull;
+	for (i = 0; i < depth; i++) {
+		if (usbfs_pair_submit(&pairs[i]))
+			errors++;
+		if (pairs[i].queued)
+			active++;
+		if (errors)
+			break;
+	}
+	while (active) {
+		n = usbfs_reap(done, 2 * depth, USBFS_TIMEOUT);
+		if (n <= 0) {
+			errors++;
+			break;
+		}
+		reaps++;
+		for (i = 0; i < n; i++) {
+			struct usbfs_pair *pair = done[i]->usercontext;
+
+			if (done[i]->status < 0)
+				pair->failed = 1;
+			pair->queued &= done[i] == &pair->in ? ~USBFS_QUEUED_IN : ~USBFS_QUEUED_OUT;
+			if (pair->queued)
+				continue;
+			if (pair->failed) {
+				errors++;
+				active--;
+				continue;
+			}
+			lat_add(&rtt, now_ns() - pair->start_ns);
+			if (errors || now_ns() >= end) {
+				active--;
+			}
+			else if (usbfs_pair_submit(pair)) {
+				errors++;
+				if (!pair->queued)
+					active--;
+			}
+		}
+	}
+	// On a timeout or error, take back whatever is still queued before
+	// the URBs and buffers are freed
+	for (i = 0, n = 0; active && i < depth; i++) {
+		if (pairs[i].queued & USBFS_QUEUED_IN)
+			done[n++] = &pairs[i].in;
+		if (pairs[i].queued & USBFS_QUEUED_OUT)
+			done[n++] = &pairs[i].out;
+	}
+	if (n > 0)
+		usbfs_drain(done, n);
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+	free(pairs);
+	free(done);
+	free(bufs);
+
+	printf("- Transfers: %llu (%.1f/s), errors: %lu\n",
+		(unsigned long long)rtt.count, rtt.count * 1e9 / elapsed, errors);
+	printf("- Completions per epoll wakeup: %.2f\n", reaps ? rtt.count * 2.0 / reaps : 0.0);
+	lat_print("Round trip", &rtt);
+	cpu_print(cpu, elapsed, rtt.count);
+	return errors ? -1 : 0;
+}
+
+static int usbfs_clear_halt(unsigned char ep)
+{
+	unsigned int endpoint = ep;
+
+	if (ioctl(usbfs_fd, USBDEVFS_CLEAR_HALT, &endpoint) < 0)
+		return ioctl(usbfs_fd, USBDEVFS_RESETEP, &endpoint);
+	return 0;
+}
+
+static int usbfs_reset(void)
+{
+	return ioctl(usbfs_fd, USBDEVFS_RESET, NULL);
+}
+
+const struct backend backend_usbfs = {
+	"usbfs", usbfs_init, usbfs_open, usbfs_is_open, usbfs_close, usbfs_loop_back, usbfs_pipeline,
+	usbfs_string, usbfs_clear_halt, usbfs_reset, NULL, NULL, NULL,
+};
+
+#endif
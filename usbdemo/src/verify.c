@@ -0,0 +1,185 @@
+#include <string.h>
+#include "verify.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define VERIFY_HAVE_SSE42
+#endif
+
+// Castagnoli polynomial, reflected
+#define CRC32C_POLY 0x82f63b78u
+
+int verify_pattern;
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+// PRBS is xorshift64: linear over GF(2) like an LFSR, period 2^64 - 1, but
+// 8 bytes per step instead of one bit. The counter is 32-bit words counting up.
+void verify_fill(uint8_t *buf, size_t len, uint64_t *state)
+{
+	uint64_t x = *state ? *state : 1, word;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(word)) {
+		if (verify_pattern == VERIFY_COUNTER) {
+			uint32_t n = (uint32_t)x;
+
+			word = n | (uint64_t)(n + 1) << 32;
+			x += 2;
+		}
+		else {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			word = x;
+		}
+		// Byte order of the host is fine, only the echo is compared
+		memcpy(buf + i, &word, len - i < sizeof(word) ? len - i : sizeof(word));
+	}
+	*state = x;
+}
+
+size_t verify_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	// 64 bytes per round, the 16-byte steps below find the offset
+	for (; i + 64 <= len; i += 64) {
+		__m128i eq = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)))));
+
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+	for (; i + 16 <= len; i += 16) {
+		unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)))) ^ 0xffff;
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+#else
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t x, y;
+
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			break;
+	}
+#endif
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			return i;
+	return len;
+}
+
+// Slicing by 8: one table lookup per byte, eight bytes per round
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t word;
+
+	crc = ~crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, sizeof(word));
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff]
+			^ crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff]
+			^ crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff]
+			^ crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef VERIFY_HAVE_SSE42
+// The crc32 instruction, 8 bytes per instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = ~crc, word;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, sizeof(word));
+		c = _mm_crc32_u64(c, word);
+	}
+	while (len--)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+void verify_init(void)
+{
+	uint32_t crc;
+	unsigned i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+	crc32c_fn = crc32c_sw;
+#ifdef VERIFY_HAVE_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_fn = crc32c_hw;
+#endif
+}
+
+int verify_parse(const char *name)
+{
+	if (strcmp(name, "counter") == 0)
+		return VERIFY_COUNTER;
+	if (strcmp(name, "prbs") == 0)
+		return VERIFY_PRBS;
+	return -1;
+}
+
+const char *verify_name(void)
+{
+	return verify_pattern == VERIFY_COUNTER ? "counter" : verify_pattern == VERIFY_PRBS ? "prbs" : "off";
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32c_fn(crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+	return crc32c_fn == crc32c_sw ? "table" : "sse4.2";
+}
+
+void verify_seal(uint8_t *buf, size_t len, uint64_t *state)
+{
+	uint32_t crc;
+
+	verify_fill(buf, len - VERIFY_SEAL_SIZE, state);
+	crc = crc32c(0, buf, len - VERIFY_SEAL_SIZE);
+	memcpy(buf + len - VERIFY_SEAL_SIZE, &crc, VERIFY_SEAL_SIZE);
+}
+
+int verify_sealed(const uint8_t *buf, size_t len)
+{
+	uint32_t crc;
+
+	if (len <= VERIFY_SEAL_SIZE)
+		return -1;
+	memcpy(&crc, buf + len - VERIFY_SEAL_SIZE, VERIFY_SEAL_SIZE);
+	return crc32c(0, buf, len - VERIFY_SEAL_SIZE) == crc ? 0 : -1;
+}
@@ -0,0 +1,46 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Payload verification
+*
+* OUT buffers are filled with a pattern that changes from one transfer to
+* the next, so a stale or partly old echo does not pass. Where the sent
+* buffer is at hand the echo is compared with it 16 bytes at a time;
+* where it is not, on the bulk reader threads, the buffer carries its own
+* CRC32C in the last 4 bytes. Both run at several GB/s, far above what
+* the bus can deliver.
+*/
+//@{
+
+enum { VERIFY_OFF, VERIFY_COUNTER, VERIFY_PRBS };
+
+extern int verify_pattern;      // VERIFY_OFF: payloads are not checked
+
+#define VERIFY_SEAL_SIZE    4   // CRC32C trailer of a sealed buffer
+
+//@}
+
+// Picks the CRC32C implementation, before any other call
+void verify_init(void);
+// VERIFY_* for a pattern name, -1 when unknown
+int verify_parse(const char *name);
+const char *verify_name(void);
+
+// Next len bytes of the pattern, state carries it from one buffer to the next
+void verify_fill(uint8_t *buf, size_t len, uint64_t *state);
+// Offset of the first byte that differs, len when none does
+size_t verify_mismatch(const uint8_t *a, const uint8_t *b, size_t len);
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// "sse4.2" or "table"
+const char *crc32c_impl(void);
+// Pattern up to the trailer, then the CRC32C of it; len > VERIFY_SEAL_SIZE
+void verify_seal(uint8_t *buf, size_t len, uint64_t *state);
+// 0 when the trailer matches the data before it
+int verify_sealed(const uint8_t *buf, size_t len);
+
+#endif